@@ -0,0 +1,278 @@
+#ifndef PROMISE_ALLOCATOR_H
+#define PROMISE_ALLOCATOR_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <new>
+
+/*
+   template class PoolAllocator: allocator backed by per-thread free lists of fixed size blocks
+
+     Blocks are grouped in size classes of PROMISE_POOL_GRANULARITY bytes, up to PROMISE_POOL_MAX_BLOCK bytes;
+     larger or over-aligned requests go to operator new.
+     A freed block goes to the free list of the freeing thread, which keeps at most PROMISE_POOL_CACHE_SIZE blocks per
+     size class. Beyond that it hands the PROMISE_POOL_TRANSFER_SIZE blocks it freed longest ago, the cold end of the
+     list, as one batch to a shared transfer cache, which threads with an empty free list take batches from: promises
+     made on one thread and freed on another come back to the first without the heap. The transfer cache keeps at most
+     PROMISE_POOL_SHARED_SIZE blocks per size class and returns the rest to the heap. Free lists are released when
+     their thread exits.
+     Promise uses it for state blocks and continuation nodes; any other allocator can be passed to the Promise constructor.
+ */
+
+#ifndef PROMISE_POOL_GRANULARITY
+#define PROMISE_POOL_GRANULARITY 16
+#endif
+
+#ifndef PROMISE_POOL_MAX_BLOCK
+#define PROMISE_POOL_MAX_BLOCK 256
+#endif
+
+#ifndef PROMISE_POOL_CACHE_SIZE
+#define PROMISE_POOL_CACHE_SIZE 1024
+#endif
+
+#ifndef PROMISE_POOL_TRANSFER_SIZE
+#define PROMISE_POOL_TRANSFER_SIZE 32
+#endif
+
+#ifndef PROMISE_POOL_SHARED_SIZE
+#define PROMISE_POOL_SHARED_SIZE 16384
+#endif
+
+namespace NPromise {
+
+  namespace NDetail {
+    class BlockPool
+    {
+    public:
+      static void* Allocate(std::size_t aSize)
+      {
+        if (aSize == 0 || aSize > PROMISE_POOL_MAX_BLOCK)
+          return ::operator new(aSize);
+
+        ThreadCache& cache = GetThreadCache();
+        std::size_t index = SizeClass(aSize);
+        if (!cache.iFree[index] && !cache.iReleased)
+          cache.iCount[index] = GetTransferCache().Take(index, cache.iFree[index], cache.iTail[index]);
+        if (Block* block = cache.iFree[index])
+        {
+          cache.iFree[index] = block->iNext;
+          if (!block->iNext)
+            cache.iTail[index] = nullptr;
+          --cache.iCount[index];
+          return block;
+        }
+        return ::operator new((index + 1) * PROMISE_POOL_GRANULARITY);
+      }
+
+      static void Deallocate(void* aPointer, std::size_t aSize) noexcept
+      {
+        if (aSize == 0 || aSize > PROMISE_POOL_MAX_BLOCK)
+        {
+          ::operator delete(aPointer);
+          return;
+        }
+
+        ThreadCache& cache = GetThreadCache();
+        std::size_t index = SizeClass(aSize);
+        if (cache.iReleased)
+        {
+          ::operator delete(aPointer);
+          return;
+        }
+        if (cache.iCount[index] >= PROMISE_POOL_CACHE_SIZE)
+        {
+          GetTransferCache().Give(index, cache.iFree[index], cache.iTail[index]);
+          cache.iCount[index] -= PROMISE_POOL_TRANSFER_SIZE;
+        }
+        Block* head = cache.iFree[index];
+        Block* block = new (aPointer) Block{head, {nullptr}};
+        if (head)
+          head->iPrevious = block;
+        else
+          cache.iTail[index] = block;
+        cache.iFree[index] = block;
+        ++cache.iCount[index];
+      }
+
+    private:
+      static constexpr std::size_t kClassCount = (PROMISE_POOL_MAX_BLOCK + PROMISE_POOL_GRANULARITY - 1) / PROMISE_POOL_GRANULARITY;
+
+      // Free lists run from the block freed last to the one freed first, which Give() hands over first
+      struct Block
+      {
+        Block* iNext;
+        union
+        {
+          Block* iPrevious;  // in a free list, except in its first block
+          Block* iNextBatch; // in the first block of a batch in the transfer cache
+        };
+      };
+
+      static_assert(sizeof(Block) <= PROMISE_POOL_GRANULARITY, "PROMISE_POOL_GRANULARITY is too small to link free blocks");
+      static_assert(PROMISE_POOL_TRANSFER_SIZE > 0 && PROMISE_POOL_TRANSFER_SIZE <= PROMISE_POOL_CACHE_SIZE,
+                    "PROMISE_POOL_TRANSFER_SIZE must be between 1 and PROMISE_POOL_CACHE_SIZE");
+
+      static void DeleteList(Block* aBlock) noexcept
+      {
+        while (aBlock)
+        {
+          Block* next = aBlock->iNext;
+          ::operator delete(aBlock);
+          aBlock = next;
+        }
+      }
+
+      // Batches of blocks on their way from the threads that free them to threads that allocate; one lock per batch
+      class TransferCache
+      {
+      public:
+        // Moves the last PROMISE_POOL_TRANSFER_SIZE blocks of the list aFree to aTail here, or to the heap once this is
+        // full: the blocks freed longest ago, which are the least likely to be in the cache of the freeing thread
+        void Give(std::size_t aIndex, Block*& aFree, Block*& aTail) noexcept
+        {
+          Block* batch = aTail;
+          for (std::size_t i = 1; i < PROMISE_POOL_TRANSFER_SIZE; ++i)
+            batch = batch->iPrevious;
+          if (batch == aFree)
+            aFree = aTail = nullptr;
+          else
+          {
+            aTail = batch->iPrevious;
+            aTail->iNext = nullptr;
+          }
+
+          SizeClassBatches& batches = iClasses[aIndex];
+          {
+            std::lock_guard<std::mutex> l(batches.iMutex);
+            if (batches.iCount.load(std::memory_order_relaxed) < kMaxBatches)
+            {
+              batch->iNextBatch = batches.iFirst;
+              batches.iFirst = batch;
+              batches.iCount.store(batches.iCount.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+              return;
+            }
+          }
+          DeleteList(batch);
+        }
+
+        // Takes one batch into the empty list aFree to aTail; returns the number of blocks taken
+        std::size_t Take(std::size_t aIndex, Block*& aFree, Block*& aTail) noexcept
+        {
+          SizeClassBatches& batches = iClasses[aIndex];
+          // Unlocked check: a thread that only allocates does not take the lock for every block
+          if (batches.iCount.load(std::memory_order_relaxed) == 0)
+            return 0;
+
+          std::lock_guard<std::mutex> l(batches.iMutex);
+          Block* batch = batches.iFirst;
+          if (!batch)
+            return 0;
+          batches.iFirst = batch->iNextBatch;
+          batches.iCount.store(batches.iCount.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+          aFree = aTail = batch;
+          while (aTail->iNext)
+            aTail = aTail->iNext;
+          return PROMISE_POOL_TRANSFER_SIZE;
+        }
+
+      private:
+        static constexpr std::size_t kMaxBatches = PROMISE_POOL_SHARED_SIZE / PROMISE_POOL_TRANSFER_SIZE;
+
+        struct SizeClassBatches
+        {
+          std::mutex iMutex;
+          Block* iFirst = nullptr;
+          std::atomic<std::size_t> iCount{0};
+        };
+
+        SizeClassBatches iClasses[kClassCount];
+      };
+
+      // Never destroyed: threads may still free blocks during static destruction
+      static TransferCache& GetTransferCache()
+      {
+        static TransferCache* cache = new TransferCache;
+        return *cache;
+      }
+
+      // Trivially destructible, so blocks freed by thread_local destructors that run after Release() still find it
+      struct ThreadCache
+      {
+        Block* iFree[kClassCount];
+        Block* iTail[kClassCount];
+        std::size_t iCount[kClassCount];
+        bool iReleased;
+
+        void Release() noexcept
+        {
+          iReleased = true;
+          for (std::size_t i = 0; i < kClassCount; ++i)
+          {
+            DeleteList(iFree[i]);
+            iFree[i] = nullptr;
+            iTail[i] = nullptr;
+            iCount[i] = 0;
+          }
+        }
+      };
+
+      struct ThreadCacheReleaser
+      {
+        ThreadCache& iCache;
+
+        ~ThreadCacheReleaser() { iCache.Release(); }
+      };
+
+      static std::size_t SizeClass(std::size_t aSize) { return (aSize - 1) / PROMISE_POOL_GRANULARITY; }
+
+      static ThreadCache& GetThreadCache()
+      {
+        static thread_local ThreadCache cache = {};
+        static thread_local ThreadCacheReleaser releaser{cache};
+        (void)releaser;
+        return cache;
+      }
+    };
+  }
+
+  template<typename taValue>
+  class PoolAllocator
+  {
+  public:
+    typedef taValue value_type;
+
+    PoolAllocator() noexcept {}
+
+    template<typename taOther>
+    PoolAllocator(const PoolAllocator<taOther>&) noexcept {}
+
+    taValue* allocate(std::size_t aCount)
+    {
+      if constexpr (alignof(taValue) > alignof(std::max_align_t))
+        return std::allocator<taValue>().allocate(aCount);
+      else
+        return static_cast<taValue*>(NDetail::BlockPool::Allocate(aCount * sizeof(taValue)));
+    }
+
+    void deallocate(taValue* aPointer, std::size_t aCount) noexcept
+    {
+      if constexpr (alignof(taValue) > alignof(std::max_align_t))
+        std::allocator<taValue>().deallocate(aPointer, aCount);
+      else
+        NDetail::BlockPool::Deallocate(aPointer, aCount * sizeof(taValue));
+    }
+
+    template<typename taOther>
+    bool operator==(const PoolAllocator<taOther>&) const noexcept { return true; }
+
+    template<typename taOther>
+    bool operator!=(const PoolAllocator<taOther>&) const noexcept { return false; }
+  };
+
+} // namespace NPromise
+
+#endif // PROMISE_ALLOCATOR_H
@@ -0,0 +1,797 @@
+#include "parallel.h"
+#include "promise.h"
+#include "stream.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <thread>
+#include <vector>
+
+using namespace NPromise;
+
+#ifndef BENCHMARK_ALL_TEMPORARIES
+#define BENCHMARK_ALL_TEMPORARIES 100000
+#endif
+
+/*
+   Benchmark driver: make benchmark, or make check-tsan for a ThreadSanitizer build (see Makefile)
+
+     footprint     size of a Promise and heap allocations per promise with std::allocator; the program fails if a
+                   Promise is not one pointer wide, its state takes more than one allocation, or a pending promise
+                   with then() and Timeout() attached is not freed once its last handle is dropped
+     creation      promises created and settled per second, on the default executor and on the inline executor
+     churn         short-lived promise plus one then(), dropped right away: shows the allocations the pools save
+     resolved      Promise<T>::Resolved() plus then() on the settled promise, which runs on the calling thread
+     cross-thread  promises created on one thread, settled and freed on another; fails the program if their blocks do
+                   not find their way back to the creating thread without the heap
+     chain         latency per then() link for chain depths 1 to 10k, measured from resolving the root to the last link
+     fan-out       All() over 2 to 100k inputs, from creating the inputs to the fulfilled output
+     All() temporaries  BENCHMARK_ALL_TEMPORARIES (100k; 1M in the ThreadSanitizer build) tuple and vector All()
+                   calls from every hardware thread at once, over temporary inputs only, one in four with a rejected
+                   input; fails the program if an output settled wrong
+     then() fan-out  10k then() on one promise whose handlers read that promise; reports how many ran at once and
+                   fails the program unless every handler ran exactly once and saw the right result, and unless at
+                   least two ran at once where the executor and the hardware have more than one thread
+                   chain, the fan-outs and All() temporaries run on a ThreadPoolExecutor ("pool") and a
+                   WorkStealingExecutor ("stealing")
+     busy settler  a handler on a two-thread WorkStealingExecutor settles a promise, then computes for 100 ms; fails the
+                   program if the continuation of that promise waits for the computation instead of running on the
+                   idle worker
+     settle        resolving 1000 promises with a then() on the executor each, one resolver call at a time and with one
+                   SettleBatch, measured until every then() ran
+     stream        values written by a thread into an AsyncStream, through map() and read with TryNext()/next()
+     parallel      MapReduce() sum over 10M elements, per element, next to the same loop on the calling thread
+     polling       GetResult()/isFulfilled() from every hardware thread on one promise
+     then()        allocations per then() for the different handler types, with warm pools: zero, the handlers fit
+                   in the small buffer of the continuation, a resolve and a reject std::function included
+     Promise(TExecutor)  allocations per promise made from a Promise<int>::TExecutor, with warm pools: zero, the task
+                   that runs it holds the TExecutor in its small buffer. Both fail the program on any allocation
+     metrics       GetMetrics() after all runs above: zero unless built with -DPROMISE_METRICS
+
+   allocations are counted by replacing every form of the global operator new and delete; threads is the thread count
+   of the process after each run (read from /proc/self/status, -1 where that is not available)
+ */
+
+static std::atomic<long> allocationCount(0);
+
+// Every replaceable form of operator new and delete goes through these two, out of line, so that the compiler never
+// pairs a free() it inlined into operator delete with an operator new it cannot see the malloc() of
+[[gnu::noinline]] static void* CountedAllocate(std::size_t aSize, std::size_t aAlignment) noexcept
+{
+  allocationCount.fetch_add(1, std::memory_order_relaxed);
+  if (aSize == 0)
+    aSize = 1;
+  if (aAlignment <= alignof(std::max_align_t))
+    return std::malloc(aSize);
+  return std::aligned_alloc(aAlignment, (aSize + aAlignment - 1) / aAlignment * aAlignment);
+}
+
+[[gnu::noinline]] static void CountedFree(void* aPointer) noexcept
+{
+  std::free(aPointer);
+}
+
+static void* CountedNew(std::size_t aSize, std::size_t aAlignment)
+{
+  if (void* p = CountedAllocate(aSize, aAlignment))
+    return p;
+  throw std::bad_alloc();
+}
+
+void* operator new(std::size_t aSize) { return CountedNew(aSize, 0); }
+void* operator new[](std::size_t aSize) { return CountedNew(aSize, 0); }
+void* operator new(std::size_t aSize, std::align_val_t aAlignment) { return CountedNew(aSize, std::size_t(aAlignment)); }
+void* operator new[](std::size_t aSize, std::align_val_t aAlignment) { return CountedNew(aSize, std::size_t(aAlignment)); }
+void* operator new(std::size_t aSize, const std::nothrow_t&) noexcept { return CountedAllocate(aSize, 0); }
+void* operator new[](std::size_t aSize, const std::nothrow_t&) noexcept { return CountedAllocate(aSize, 0); }
+void* operator new(std::size_t aSize, std::align_val_t aAlignment, const std::nothrow_t&) noexcept { return CountedAllocate(aSize, std::size_t(aAlignment)); }
+void* operator new[](std::size_t aSize, std::align_val_t aAlignment, const std::nothrow_t&) noexcept { return CountedAllocate(aSize, std::size_t(aAlignment)); }
+
+void operator delete(void* aPointer) noexcept { CountedFree(aPointer); }
+void operator delete[](void* aPointer) noexcept { CountedFree(aPointer); }
+void operator delete(void* aPointer, std::size_t) noexcept { CountedFree(aPointer); }
+void operator delete[](void* aPointer, std::size_t) noexcept { CountedFree(aPointer); }
+void operator delete(void* aPointer, std::align_val_t) noexcept { CountedFree(aPointer); }
+void operator delete[](void* aPointer, std::align_val_t) noexcept { CountedFree(aPointer); }
+void operator delete(void* aPointer, std::size_t, std::align_val_t) noexcept { CountedFree(aPointer); }
+void operator delete[](void* aPointer, std::size_t, std::align_val_t) noexcept { CountedFree(aPointer); }
+void operator delete(void* aPointer, const std::nothrow_t&) noexcept { CountedFree(aPointer); }
+void operator delete[](void* aPointer, const std::nothrow_t&) noexcept { CountedFree(aPointer); }
+void operator delete(void* aPointer, std::align_val_t, const std::nothrow_t&) noexcept { CountedFree(aPointer); }
+void operator delete[](void* aPointer, std::align_val_t, const std::nothrow_t&) noexcept { CountedFree(aPointer); }
+
+static_assert(sizeof(Promise<int>) == sizeof(void*), "a Promise is a single pointer to its state");
+static_assert(sizeof(Promise<std::vector<int>>) == sizeof(void*), "a Promise is a single pointer to its state");
+
+namespace {
+  typedef std::chrono::steady_clock TClock;
+
+  int ThreadCount()
+  {
+    int count = -1;
+    if (std::FILE* f = std::fopen("/proc/self/status", "r"))
+    {
+      char line[256];
+      while (std::fgets(line, sizeof(line), f))
+        if (std::strncmp(line, "Threads:", 8) == 0)
+          count = std::atoi(line + 8);
+      std::fclose(f);
+    }
+    return count;
+  }
+
+  template<typename taResolvedType>
+  void Wait(const Promise<taResolvedType>& aPromise)
+  {
+    while (aPromise.isPending())
+      std::this_thread::yield();
+  }
+
+  // Pending promise and the resolver that settles it
+  struct Deferred
+  {
+    Promise<int> iPromise;
+    Promise<int>::TResolver iResolve;
+  };
+
+  Deferred MakeDeferred(Executor& aScheduler)
+  {
+    Promise<int>::TResolver resolver;
+    std::atomic<bool> ready(false);
+    Promise<int> p([&](const Promise<int>::TResolver& r, const Promise<int>::TRejecter&){
+                     resolver = r;
+                     ready.store(true, std::memory_order_release);
+                   }, &aScheduler);
+    while (!ready.load(std::memory_order_acquire))
+      std::this_thread::yield();
+    return Deferred{p, resolver};
+  }
+
+  void Report(const char* aName, long aCount, TClock::duration aElapsed, long aAllocations)
+  {
+    double ns = std::chrono::duration<double, std::nano>(aElapsed).count();
+    std::printf("%-36s %8ld %12.1f ns/op %14.0f op/s %8.2f allocs/op %4d threads\n",
+                aName, aCount, ns / aCount, aCount / (ns * 1e-9), double(aAllocations) / aCount, ThreadCount());
+  }
+
+  // std::allocator that counts the blocks it handed out and did not get back yet
+  template<typename taType>
+  struct CountingAllocator
+  {
+    typedef taType value_type;
+
+    CountingAllocator() {}
+    template<typename taOther> CountingAllocator(const CountingAllocator<taOther>&) {}
+
+    taType* allocate(std::size_t aCount)
+    {
+      Live().fetch_add(1);
+      return std::allocator<taType>().allocate(aCount);
+    }
+
+    void deallocate(taType* aPointer, std::size_t aCount)
+    {
+      Live().fetch_sub(1);
+      std::allocator<taType>().deallocate(aPointer, aCount);
+    }
+
+    static std::atomic<long>& Live()
+    {
+      static std::atomic<long> live(0);
+      return live;
+    }
+
+    template<typename taOther> bool operator==(const CountingAllocator<taOther>&) const { return true; }
+    template<typename taOther> bool operator!=(const CountingAllocator<taOther>&) const { return false; }
+  };
+
+  // A pending promise whose handles are all dropped must be freed with the continuations attached to it
+  bool DroppedPending()
+  {
+    std::shared_ptr<int> captured = std::make_shared<int>(0);
+    {
+      Promise<int> p(std::allocator_arg, CountingAllocator<char>(),
+                     [](const Promise<int>::TResolver&, const Promise<int>::TRejecter&){}, &GetInlineExecutor());
+      p.then([captured](const int& a){ return a + *captured; });
+      p.Timeout(std::chrono::hours(1));
+    }
+    bool freed = CountingAllocator<char>::Live().load() == 0 && captured.use_count() == 1;
+    std::printf("pending promise with then() and Timeout() dropped: %s\n", freed ? "freed" : "leaked");
+    return freed;
+  }
+
+  // State, result storage and continuation list in one block: bypasses the pool so every block is a heap allocation
+  bool Footprint(long aCount)
+  {
+    Executor& caller = GetInlineExecutor();
+    // One promise first, so one-time setup (registering the thread for PROMISE_METRICS) is not counted
+    long sum = Promise<int>(std::allocator_arg, std::allocator<char>(),
+                            [](const Promise<int>::TResolver& r, const Promise<int>::TRejecter&){ r(0); }, &caller).GetResult();
+
+    long allocations = allocationCount.load();
+    TClock::time_point start = TClock::now();
+    for (long i = 0; i < aCount; ++i)
+    {
+      Promise<int> p(std::allocator_arg, std::allocator<char>(),
+                     [i](const Promise<int>::TResolver& r, const Promise<int>::TRejecter&){ r(int(i)); }, &caller);
+      sum += p.GetResult();
+    }
+    allocations = allocationCount.load() - allocations;
+    Report("create+settle, std::allocator", aCount, TClock::now() - start, allocations);
+    std::printf("sizeof(Promise<int>) %zu, sizeof(Promise<std::vector<int>>) %zu\n",
+                sizeof(Promise<int>), sizeof(Promise<std::vector<int>>));
+    if (sum == 0)
+      std::printf("unexpected sum\n");
+    return allocations == aCount && DroppedPending();
+  }
+
+  void Creation(const char* aName, Executor& aScheduler, long aCount)
+  {
+    std::vector<Promise<int>> promises;
+    promises.reserve(aCount);
+
+    long allocations = allocationCount.load();
+    TClock::time_point start = TClock::now();
+    for (long i = 0; i < aCount; ++i)
+      promises.push_back(Promise<int>([i](const Promise<int>::TResolver& r, const Promise<int>::TRejecter&){ r(int(i)); }, &aScheduler));
+    for (const Promise<int>& p : promises)
+      Wait(p);
+    Report(aName, aCount, TClock::now() - start, allocationCount.load() - allocations);
+  }
+
+  // Short-lived promises: each one is dropped before the next is created, so state blocks and continuations are reused
+  void Churn(const char* aName, long aCount)
+  {
+    Executor& caller = GetInlineExecutor();
+    long sum = 0;
+
+    long allocations = allocationCount.load();
+    TClock::time_point start = TClock::now();
+    for (long i = 0; i < aCount; ++i)
+    {
+      Promise<int> p([i](const Promise<int>::TResolver& r, const Promise<int>::TRejecter&){ r(int(i)); }, &caller);
+      Promise<int> q = p.then([](const int& a){ return a + 1; }, &caller);
+      sum += q.GetResult();
+    }
+    Report(aName, aCount, TClock::now() - start, allocationCount.load() - allocations);
+    if (sum == 0)
+      std::printf("unexpected sum\n");
+  }
+
+  // Cache-hit path: Resolved() plus a then() on the settled promise, both without thread handoff
+  void ResolvedThen(const char* aName, long aCount)
+  {
+    long sum = 0;
+
+    long allocations = allocationCount.load();
+    TClock::time_point start = TClock::now();
+    for (long i = 0; i < aCount; ++i)
+      sum += Promise<int>::Resolved(int(i)).then([](const int& a){ return a + 1; }).GetResult();
+    Report(aName, aCount, TClock::now() - start, allocationCount.load() - allocations);
+    if (sum == 0)
+      std::printf("unexpected sum\n");
+  }
+
+  // Producer/consumer: the creating thread hands each resolver to a second thread through a ring buffer and drops its
+  // handle, so every state is freed by the consumer. False if that costs more than one heap allocation per 100 promises
+  bool CrossThread(long aCount)
+  {
+    const long capacity = 256;
+    std::vector<Promise<int>::TResolver> ring(capacity);
+    std::atomic<long> written(0);
+    std::atomic<long> read(0);
+    const long total = 2 * aCount; // the first half fills the pools
+    std::thread consumer([&]()
+    {
+      for (long i = 0; i < total; ++i)
+      {
+        while (written.load(std::memory_order_acquire) == i)
+          std::this_thread::yield();
+        Promise<int>::TResolver resolver = std::move(ring[i % capacity]);
+        ring[i % capacity] = Promise<int>::TResolver();
+        read.store(i + 1, std::memory_order_release);
+        resolver(int(i));
+      }
+    });
+
+    long allocations = 0;
+    TClock::time_point start;
+    for (long i = 0; i < total; ++i)
+    {
+      if (i == aCount)
+      {
+        allocations = allocationCount.load();
+        start = TClock::now();
+      }
+      while (i - read.load(std::memory_order_acquire) >= capacity)
+        std::this_thread::yield();
+      Promise<int>([&ring, i, capacity](const Promise<int>::TResolver& r, const Promise<int>::TRejecter&){ ring[i % capacity] = r; },
+                   &GetInlineExecutor());
+      written.store(i + 1, std::memory_order_release);
+    }
+    consumer.join();
+    allocations = allocationCount.load() - allocations;
+    Report("create+settle across threads", aCount, TClock::now() - start, allocations);
+    return allocations * 100 <= aCount;
+  }
+
+  void Chain(const char* aLabel, Executor& aScheduler, long aDepth)
+  {
+    Deferred root = MakeDeferred(aScheduler);
+
+    long allocations = allocationCount.load();
+    Promise<int> last = root.iPromise;
+    for (long i = 0; i < aDepth; ++i)
+      last = std::move(last).then([](const int& a){ return a + 1; });
+    allocations = allocationCount.load() - allocations;
+
+    TClock::time_point start = TClock::now();
+    root.iResolve(0);
+    Wait(last);
+    TClock::duration elapsed = TClock::now() - start;
+
+    char name[64];
+    std::snprintf(name, sizeof(name), "%s chain depth %ld", aLabel, aDepth);
+    Report(name, aDepth, elapsed, allocations);
+  }
+
+  void FanOut(const char* aLabel, Executor& aScheduler, long aCount)
+  {
+    long allocations = allocationCount.load();
+    TClock::time_point start = TClock::now();
+
+    std::vector<Promise<int>> inputs;
+    inputs.reserve(aCount);
+    for (long i = 0; i < aCount; ++i)
+      inputs.push_back(Promise<int>([i](const Promise<int>::TResolver& r, const Promise<int>::TRejecter&){ r(int(i)); }, &aScheduler));
+    Promise<std::vector<int>> all = All(inputs, &aScheduler);
+    Wait(all);
+
+    TClock::duration elapsed = TClock::now() - start;
+    char name[64];
+    std::snprintf(name, sizeof(name), "%s All() fan-out %ld", aLabel, aCount);
+    Report(name, aCount, elapsed, allocationCount.load() - allocations);
+  }
+
+  // Neither the caller nor anything else keeps the inputs: the aggregate of each All() has to outlive them and the call.
+  // Each thread checks its outputs every 10000 calls, so a long run does not keep them all.
+  // False if an output settled with a wrong result, or did not reject when one of its inputs did
+  bool AllTemporaries(const char* aLabel, Executor& aScheduler, long aCount)
+  {
+    auto input = [&aScheduler](long aValue, bool aReject)
+    {
+      return Promise<long>([aValue, aReject](const Promise<long>::TResolver& r, const Promise<long>::TRejecter& e)
+      {
+        if (aReject)
+          e("rejected input");
+        else
+          r(aValue);
+      }, &aScheduler);
+    };
+    const long threadCount = std::max(2u, std::thread::hardware_concurrency());
+    std::atomic<long> wrong(0);
+
+    long allocations = allocationCount.load();
+    TClock::time_point start = TClock::now();
+    std::vector<std::thread> threads;
+    for (long t = 0; t < threadCount; ++t)
+      threads.emplace_back([&, t]()
+      {
+        const long window = 10000;
+        std::vector<Promise<std::tuple<long, long>>> tuples;
+        std::vector<Promise<std::vector<long>>> vectors;
+        for (long first = t; first < aCount; first += window * threadCount)
+        {
+          long last = std::min(aCount, first + window * threadCount);
+          for (long i = first; i < last; i += threadCount)
+          {
+            bool reject = i % 4 == 3;
+            tuples.push_back(All(aScheduler, input(i, false), input(i + 1, reject)));
+            vectors.push_back(All(std::vector<Promise<long>>{input(i, reject), input(i + 2, false)}, &aScheduler));
+          }
+          for (std::size_t k = 0; k < tuples.size(); ++k)
+          {
+            long i = first + long(k) * threadCount;
+            bool reject = i % 4 == 3;
+            Wait(tuples[k]);
+            Wait(vectors[k]);
+            if (reject ? !tuples[k].isRejected() || !vectors[k].isRejected()
+                       : !tuples[k].isFulfilled() || tuples[k].GetResult() != std::make_tuple(i, i + 1) ||
+                         !vectors[k].isFulfilled() || vectors[k].GetResult() != std::vector<long>{i, i + 2})
+              wrong.fetch_add(1);
+          }
+          tuples.clear();
+          vectors.clear();
+        }
+      });
+    for (std::thread& t : threads)
+      t.join();
+    TClock::duration elapsed = TClock::now() - start;
+
+    char name[64];
+    std::snprintf(name, sizeof(name), "%s All() temporaries %ld", aLabel, aCount);
+    Report(name, aCount, elapsed, allocationCount.load() - allocations);
+    return wrong.load() == 0;
+  }
+
+  // Many then() on one parent: the handlers read the parent while they run and spin for a microsecond each, so they
+  // overlap on every worker thread unless something serializes them. False if a handler saw a wrong parent or result,
+  // if a handler did not run exactly once, or if no two ran at once although aThreadCount and the hardware allow it
+  bool ThenFanOut(const char* aLabel, Executor& aScheduler, std::size_t aThreadCount, long aCount)
+  {
+    Promise<int>::TResolver resolver;
+    Promise<int> parent([&resolver](const Promise<int>::TResolver& r, const Promise<int>::TRejecter&){ resolver = r; },
+                        &GetInlineExecutor());
+    std::atomic<long> running(0);
+    std::atomic<long> peak(0);
+    std::atomic<long> wrong(0);
+    std::vector<std::atomic<int>> runs(aCount);
+
+    long allocations = allocationCount.load();
+    TClock::time_point start = TClock::now();
+    std::vector<Promise<long>> children;
+    children.reserve(aCount);
+    for (long i = 0; i < aCount; ++i)
+      children.push_back(parent.then([&, i](const int& a) -> long
+      {
+        runs[i].fetch_add(1);
+        long now = running.fetch_add(1) + 1;
+        long seen = peak.load();
+        while (now > seen && !peak.compare_exchange_weak(seen, now))
+          ;
+        if (!parent.isFulfilled() || parent.GetResult() != a)
+          wrong.fetch_add(1);
+        TClock::time_point until = TClock::now() + std::chrono::microseconds(1);
+        while (TClock::now() < until)
+          ;
+        running.fetch_sub(1);
+        return a + i;
+      }, &aScheduler));
+    resolver(7);
+    for (long i = 0; i < aCount; ++i)
+    {
+      Wait(children[i]);
+      if (children[i].GetResult() != 7 + i)
+        wrong.fetch_add(1);
+    }
+    TClock::duration elapsed = TClock::now() - start;
+    long ranOnce = std::count_if(runs.begin(), runs.end(), [](const std::atomic<int>& aRuns){ return aRuns.load() == 1; });
+
+    char name[64];
+    std::snprintf(name, sizeof(name), "%s then() fan-out %ld", aLabel, aCount);
+    Report(name, aCount, elapsed, allocationCount.load() - allocations);
+    std::printf("%s then() fan-out %ld: %ld handlers ran exactly once, at most %ld at once\n", aLabel, aCount, ranOnce, peak.load());
+    bool parallel = peak.load() > 1 || aThreadCount < 2 || std::thread::hardware_concurrency() < 2;
+    return wrong.load() == 0 && ranOnce == aCount && parallel;
+  }
+
+  // The continuation of a promise settled on a worker goes to the run next slot of that worker; while the handler that
+  // settled it keeps computing, the other worker has to take it from there. False if it ran only once the handler was
+  // halfway through
+  bool BusySettler(long aSpinMs)
+  {
+    WorkStealingExecutor stealing(2);
+    Promise<int>::TResolver resolver;
+    Promise<int> source([&resolver](const Promise<int>::TResolver& r, const Promise<int>::TRejecter&){ resolver = r; },
+                        &GetInlineExecutor());
+    TClock::time_point settled;
+    TClock::duration delay(0);
+    Promise<int> child = source.then([&](const int& a){ delay = TClock::now() - settled; return a; }, &stealing);
+
+    long allocations = allocationCount.load();
+    Promise<int> busy([&](const Promise<int>::TResolver& r, const Promise<int>::TRejecter&)
+    {
+      settled = TClock::now();
+      resolver(1);
+      while (TClock::now() < settled + std::chrono::milliseconds(aSpinMs))
+        ;
+      r(0);
+    }, &stealing);
+    Wait(child);
+    Wait(busy);
+
+    Report("stealing, then() behind a busy handler", 1, delay, allocationCount.load() - allocations);
+    return delay < std::chrono::milliseconds(aSpinMs) / 2;
+  }
+
+  // Completions of one event loop wakeup: each settle posts a continuation, unless the batch posts them all at once
+  void Settle(const char* aLabel, Executor& aScheduler, long aCount, bool aBatch)
+  {
+    std::vector<std::pair<Promise<int>::TResolver, int>> resolvers(aCount);
+    std::vector<Promise<int>> outputs;
+    outputs.reserve(aCount);
+    for (long i = 0; i < aCount; ++i)
+    {
+      Promise<int> p([&resolvers, i](const Promise<int>::TResolver& r, const Promise<int>::TRejecter&){ resolvers[i] = {r, int(i)}; },
+                     &GetInlineExecutor());
+      outputs.push_back(p.then([](const int& a){ return a + 1; }, &aScheduler));
+    }
+
+    long allocations = allocationCount.load();
+    TClock::time_point start = TClock::now();
+    if (aBatch)
+      ResolveBatch(resolvers.begin(), resolvers.end());
+    else
+      for (std::pair<Promise<int>::TResolver, int>& r : resolvers)
+        r.first(r.second);
+    for (const Promise<int>& p : outputs)
+      Wait(p);
+    TClock::duration elapsed = TClock::now() - start;
+
+    char name[64];
+    std::snprintf(name, sizeof(name), "%s settle %ld, %s", aLabel, aCount, aBatch ? "SettleBatch" : "one by one");
+    Report(name, aCount, elapsed, allocationCount.load() - allocations);
+  }
+
+  // Per value: a ring buffer slot in each of the two streams, a promise only when a side has to wait
+  void Stream(const char* aLabel, Executor& aScheduler, long aCount)
+  {
+    long allocations = allocationCount.load();
+    TClock::time_point start = TClock::now();
+
+    AsyncStream<long>::TWriter writer;
+    AsyncStream<long> source(writer, PROMISE_STREAM_CAPACITY, &aScheduler);
+    AsyncStream<long> doubled = source.map([](long a){ return 2 * a; });
+    std::thread producer([writer=std::move(writer), aCount]() mutable
+    {
+      for (long i = 0; i < aCount; ++i)
+        if (!writer.TryWrite(i))
+        {
+          Promise<bool> written = writer.Write(i);
+          written.Wait();
+        }
+      writer = AsyncStream<long>::TWriter();
+    });
+
+    long sum = 0;
+    for (;;)
+    {
+      std::optional<long> value;
+      if (!doubled.TryNext(value))
+      {
+        Promise<std::optional<long>> next = doubled.next();
+        next.Wait();
+        value = std::move(next).TakeResult();
+        if (!value)
+          break;
+      }
+      sum += *value;
+    }
+    producer.join();
+
+    TClock::duration elapsed = TClock::now() - start;
+    char name[64];
+    std::snprintf(name, sizeof(name), "%s stream map %ld", aLabel, aCount);
+    Report(name, aCount, elapsed, allocationCount.load() - allocations);
+    if (sum != aCount * (aCount - 1))
+      std::printf("unexpected sum\n");
+  }
+
+  void Parallel(const char* aLabel, Executor* aScheduler, const std::vector<int>& aData)
+  {
+    auto square = [](int a){ return long(a) * a; };
+    long allocations = allocationCount.load();
+    TClock::time_point start = TClock::now();
+    long sum = 0;
+    if (aScheduler)
+    {
+      Promise<long> total = MapReduce(aData, square, [](long a, long b){ return a + b; }, CancellationToken(), aScheduler);
+      total.Wait();
+      sum = total.GetResult();
+    }
+    else
+      for (int a : aData)
+        sum += square(a);
+    TClock::duration elapsed = TClock::now() - start;
+
+    char name[64];
+    std::snprintf(name, sizeof(name), "%s MapReduce %zu", aLabel, aData.size());
+    Report(name, long(aData.size()), elapsed, allocationCount.load() - allocations);
+    if (sum == 0)
+      std::printf("unexpected sum\n");
+  }
+
+  // Everything the runs above counted; all zero unless built with -DPROMISE_METRICS
+  void Metrics()
+  {
+    MetricsSnapshot metrics = GetMetrics();
+    std::printf("metrics: %llu created, %llu fulfilled, %llu rejected, %lld live, %lld pending, %lld queued, %lld threads\n",
+                (unsigned long long)metrics.iCreated, (unsigned long long)metrics.iFulfilled, (unsigned long long)metrics.iRejected,
+                (long long)metrics.iLive, (long long)metrics.iPending, (long long)metrics.iQueueDepth, (long long)metrics.iThreads);
+    std::printf("metrics: create->settle p50 %lld ns p99 %lld ns, settle->continuation p50 %lld ns p99 %lld ns\n",
+                (long long)metrics.iSettleLatency.GetQuantile(0.5).count(), (long long)metrics.iSettleLatency.GetQuantile(0.99).count(),
+                (long long)metrics.iContinuationDelay.GetQuantile(0.5).count(),
+                (long long)metrics.iContinuationDelay.GetQuantile(0.99).count());
+  }
+
+  void Polling(long aPollsPerThread)
+  {
+    Deferred source = MakeDeferred(GetDefaultExecutor());
+    unsigned threadCount = std::max(2u, std::thread::hardware_concurrency());
+    std::atomic<unsigned> started(0);
+    std::atomic<long> sum(0);
+
+    long allocations = allocationCount.load();
+    TClock::time_point start = TClock::now();
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < threadCount; ++t)
+      threads.emplace_back([&](){
+          started.fetch_add(1);
+          long local = 0;
+          for (long i = 0; i < aPollsPerThread; ++i)
+            if (source.iPromise.isFulfilled())
+              local += source.iPromise.GetResult();
+          sum.fetch_add(local);
+        });
+    // Settles while the pollers are running, so they see both states
+    while (started.load() < threadCount)
+      std::this_thread::yield();
+    source.iResolve(1);
+    for (std::thread& t : threads)
+      t.join();
+
+    char name[64];
+    std::snprintf(name, sizeof(name), "polling x%u threads", threadCount);
+    Report(name, aPollsPerThread * threadCount, (TClock::now() - start) * threadCount, allocationCount.load() - allocations);
+  }
+
+  // Rounds of 1000 then() on one promise, settled and dropped before the next round, so the pools serve the promise
+  // state and the continuation node of every then() once the first round filled them: what is left is what the
+  // handler costs, false unless that is nothing. With more then() alive at once than the pools hold
+  // (PROMISE_POOL_CACHE_SIZE blocks per size class) each then() beyond that takes those two blocks from the heap; the
+  // handler never adds one
+  template<typename... taHandlers>
+  bool AllocationsPerThen(const char* aName, taHandlers... aHandlers)
+  {
+    const long rounds = 10;
+    const long n = 1000;
+    std::vector<Promise<int>> children;
+    children.reserve(n);
+
+    long allocations = 0;
+    TClock::duration elapsed(0);
+    for (long round = 0; round <= rounds; ++round)
+    {
+      Deferred source = MakeDeferred(GetInlineExecutor());
+      long before = allocationCount.load();
+      TClock::time_point start = TClock::now();
+      for (long i = 0; i < n; ++i)
+        children.push_back(source.iPromise.then(aHandlers..., &GetInlineExecutor()));
+      // Round 0 fills the pools
+      if (round > 0)
+      {
+        elapsed += TClock::now() - start;
+        allocations += allocationCount.load() - before;
+      }
+      source.iResolve(0);
+      children.clear();
+    }
+    Report(aName, rounds * n, elapsed, allocations);
+    return allocations == 0;
+  }
+
+  // Same rounds for promises made from the TExecutor typedef, the way promise.cc makes them
+  bool AllocationsPerPromise(const char* aName, int aOffset)
+  {
+    const long rounds = 10;
+    const long n = 1000;
+    std::vector<Promise<int>> promises;
+    promises.reserve(n);
+
+    long allocations = 0;
+    TClock::duration elapsed(0);
+    for (long round = 0; round <= rounds; ++round)
+    {
+      long before = allocationCount.load();
+      TClock::time_point start = TClock::now();
+      for (long i = 0; i < n; ++i)
+      {
+        Promise<int>::TExecutor executor = [aOffset](const Promise<int>::TResolver& r, const Promise<int>::TRejecter&){ r(aOffset); };
+        promises.push_back(Promise<int>(std::move(executor), &GetInlineExecutor()));
+      }
+      if (round > 0)
+      {
+        elapsed += TClock::now() - start;
+        allocations += allocationCount.load() - before;
+      }
+      promises.clear();
+    }
+    Report(aName, rounds * n, elapsed, allocations);
+    return allocations == 0;
+  }
+}
+
+int main()
+{
+  std::printf("%d threads before the default executor starts\n", ThreadCount());
+
+  if (!Footprint(100000))
+  {
+    std::printf("FAILED: more than one allocation per promise, or a dropped promise was not freed\n");
+    return 1;
+  }
+  Creation("create+settle, default executor", GetDefaultExecutor(), 100000);
+  Creation("create+settle, inline executor", GetInlineExecutor(), 100000);
+  Churn("create+then+drop, inline", 100000);
+  ResolvedThen("Resolved()+then()", 100000);
+  if (!CrossThread(100000))
+  {
+    std::printf("FAILED: blocks of promises freed on another thread went back to the heap\n");
+    return 1;
+  }
+
+  ThreadPoolExecutor pool;
+  WorkStealingExecutor stealing;
+  for (long depth : {1L, 10L, 100L, 1000L, 10000L})
+  {
+    Chain("pool", pool, depth);
+    Chain("stealing", stealing, depth);
+  }
+
+  for (long count : {2L, 10L, 100L, 1000L, 10000L, 100000L})
+  {
+    FanOut("pool", pool, count);
+    FanOut("stealing", stealing, count);
+  }
+
+  if (!AllTemporaries("pool", pool, BENCHMARK_ALL_TEMPORARIES) || !AllTemporaries("stealing", stealing, BENCHMARK_ALL_TEMPORARIES))
+  {
+    std::printf("FAILED: All() over temporaries settled wrong\n");
+    return 1;
+  }
+
+  if (!ThenFanOut("pool", pool, pool.GetThreadCount(), 10000) || !ThenFanOut("stealing", stealing, stealing.GetThreadCount(), 10000))
+  {
+    std::printf("FAILED: a then() handler saw a wrong parent or result, did not run exactly once, or ran alone\n");
+    return 1;
+  }
+
+  if (!BusySettler(100))
+  {
+    std::printf("FAILED: a continuation waited for the handler that settled its promise to finish\n");
+    return 1;
+  }
+
+  for (bool batch : {false, true})
+  {
+    Settle("pool", pool, 1000, batch);
+    Settle("stealing", stealing, 1000, batch);
+  }
+
+  Stream("pool", pool, 1000000);
+  Stream("stealing", stealing, 1000000);
+
+  std::vector<int> data(10000000);
+  for (std::size_t i = 0; i < data.size(); ++i)
+    data[i] = int(i % 1000);
+  Parallel("serial", nullptr, data);
+  Parallel("pool", &pool, data);
+  Parallel("stealing", &stealing, data);
+
+  Polling(1000000);
+
+  // Not a constant, so the lambdas below really capture it
+  volatile int seed = 1;
+  int offset = seed;
+  bool noAllocations = AllocationsPerThen("then(lambda, no capture)", [](const int& a){ return a + 1; });
+  noAllocations &= AllocationsPerThen("then(lambda, int capture)", [offset](const int& a){ return a + offset; });
+  std::function<int(const int&)> handler = [offset](const int& a){ return a + offset; };
+  noAllocations &= AllocationsPerThen("then(std::function)", handler);
+  std::function<void(const int&, const Promise<int>::TResolver&, const Promise<int>::TRejecter&)> resolveHandler =
+    [offset](const int& a, const Promise<int>::TResolver& r, const Promise<int>::TRejecter&){ r(a + offset); };
+  std::function<void(const std::exception_ptr&, const Promise<int>::TResolver&, const Promise<int>::TRejecter&)> rejectHandler =
+    [offset](const std::exception_ptr&, const Promise<int>::TResolver& r, const Promise<int>::TRejecter&){ r(offset); };
+  noAllocations &= AllocationsPerThen("then(std::function, std::function)", resolveHandler, rejectHandler);
+  noAllocations &= AllocationsPerPromise("Promise(TExecutor)", offset);
+  if (!noAllocations)
+  {
+    std::printf("FAILED: a then() handler or a promise executor did not fit in the small buffer of its task\n");
+    return 1;
+  }
+  Metrics();
+  return 0;
+}
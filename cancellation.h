@@ -0,0 +1,215 @@
+#ifndef PROMISE_CANCELLATION_H
+#define PROMISE_CANCELLATION_H
+
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+#include "function.h"
+
+/*
+   class CancellationSource: cancels every CancellationToken taken from it
+
+     Cancel()
+        marks the tokens cancelled and runs the registered callbacks on the calling thread; only the first call has an effect
+
+   class CancellationToken: passed to the Promise constructor, then() and All()
+      a default constructed token is never cancelled
+      IsCancelled() can be polled by an executor
+      OnCancel(callback) runs callback when the source is cancelled, or right away if it already is; it must not throw
+      the callback is unregistered when the returned CancellationRegistration is destroyed,
+      but may still be running on the cancelling thread at that moment
+      once the last copy of its source is destroyed a token can no longer be cancelled: its callbacks are dropped
+      without running and OnCancel() no longer registers any
+
+   class CancelledError: the reason promises are rejected with when their token is cancelled
+ */
+
+namespace NPromise {
+
+  class CancelledError : public std::exception
+  {
+  public:
+    const char* what() const noexcept override { return "Promise cancelled"; }
+  };
+
+  namespace NDetail {
+    struct CancellationState
+    {
+      CancellationState()
+        : iCancelled(false), iNextId(0), iOrphaned(false)
+      {
+      }
+
+      std::atomic<bool> iCancelled;
+      std::mutex iMutex;
+      std::uint64_t iNextId;
+      std::unordered_map<std::uint64_t, Function<void()>> iCallbacks;
+      // Set under iMutex when no CancellationSource is left
+      bool iOrphaned;
+    };
+
+    // Shared by the copies of one CancellationSource
+    struct CancellationSourceOwner
+    {
+      CancellationSourceOwner()
+        : iStatePtr(std::make_shared<CancellationState>())
+      {
+      }
+
+      // Callbacks may hold what registered them (a promise state, say): dropping them breaks that cycle
+      ~CancellationSourceOwner()
+      {
+        std::unordered_map<std::uint64_t, Function<void()>> callbacks;
+        std::lock_guard<std::mutex> l(iStatePtr->iMutex);
+        iStatePtr->iOrphaned = true;
+        callbacks.swap(iStatePtr->iCallbacks);
+      }
+
+      std::shared_ptr<CancellationState> iStatePtr;
+    };
+  }
+
+  class CancellationRegistration
+  {
+  public:
+    CancellationRegistration()
+      : iId(0)
+    {
+    }
+
+    CancellationRegistration(CancellationRegistration&& aOther) noexcept
+      : iStatePtr(std::move(aOther.iStatePtr)), iId(aOther.iId)
+    {
+    }
+
+    CancellationRegistration& operator=(CancellationRegistration&& aOther) noexcept
+    {
+      if (this == &aOther)
+        return *this;
+
+      Reset();
+      iStatePtr = std::move(aOther.iStatePtr);
+      iId = aOther.iId;
+      return *this;
+    }
+
+    CancellationRegistration(const CancellationRegistration&) = delete;
+    CancellationRegistration& operator=(const CancellationRegistration&) = delete;
+
+    ~CancellationRegistration()
+    {
+      Reset();
+    }
+
+    void Reset() noexcept
+    {
+      if (!iStatePtr)
+        return;
+
+      Function<void()> callback;
+      {
+        std::lock_guard<std::mutex> l(iStatePtr->iMutex);
+        auto it = iStatePtr->iCallbacks.find(iId);
+        if (it != iStatePtr->iCallbacks.end())
+        {
+          callback = std::move(it->second);
+          iStatePtr->iCallbacks.erase(it);
+        }
+      }
+      iStatePtr.reset();
+    }
+
+  private:
+    friend class CancellationToken;
+
+    CancellationRegistration(std::shared_ptr<NDetail::CancellationState> aStatePtr, std::uint64_t aId)
+      : iStatePtr(std::move(aStatePtr)), iId(aId)
+    {
+    }
+
+    std::shared_ptr<NDetail::CancellationState> iStatePtr;
+    std::uint64_t iId;
+  };
+
+  class CancellationToken
+  {
+  public:
+    CancellationToken() {}
+
+    bool IsCancelled() const { return iStatePtr && iStatePtr->iCancelled.load(std::memory_order_acquire); }
+
+    bool CanBeCancelled() const { return iStatePtr != nullptr; }
+
+    template<typename taCallback>
+    CancellationRegistration OnCancel(taCallback&& aCallback) const
+    {
+      if (!iStatePtr)
+        return CancellationRegistration();
+
+      Function<void()> callback(std::forward<taCallback>(aCallback));
+      {
+        std::lock_guard<std::mutex> l(iStatePtr->iMutex);
+        if (iStatePtr->iOrphaned)
+          return CancellationRegistration();
+        if (!iStatePtr->iCancelled.load(std::memory_order_relaxed))
+        {
+          std::uint64_t id = ++iStatePtr->iNextId;
+          iStatePtr->iCallbacks.emplace(id, std::move(callback));
+          return CancellationRegistration(iStatePtr, id);
+        }
+      }
+      callback();
+      return CancellationRegistration();
+    }
+
+  private:
+    friend class CancellationSource;
+
+    explicit CancellationToken(std::shared_ptr<NDetail::CancellationState> aStatePtr)
+      : iStatePtr(std::move(aStatePtr))
+    {
+    }
+
+    std::shared_ptr<NDetail::CancellationState> iStatePtr;
+  };
+
+  class CancellationSource
+  {
+  public:
+    CancellationSource()
+      : iOwnerPtr(std::make_shared<NDetail::CancellationSourceOwner>())
+    {
+    }
+
+    CancellationToken GetToken() const { return CancellationToken(iOwnerPtr->iStatePtr); }
+
+    bool IsCancelled() const { return iOwnerPtr->iStatePtr->iCancelled.load(std::memory_order_acquire); }
+
+    void Cancel()
+    {
+      NDetail::CancellationState& state = *iOwnerPtr->iStatePtr;
+      std::unordered_map<std::uint64_t, Function<void()>> callbacks;
+      {
+        std::lock_guard<std::mutex> l(state.iMutex);
+        if (state.iCancelled.load(std::memory_order_relaxed))
+          return;
+        state.iCancelled.store(true, std::memory_order_release);
+        callbacks.swap(state.iCallbacks);
+      }
+      // Outside the lock: callbacks may register or reset registrations themselves
+      for (auto& callback : callbacks)
+        callback.second();
+    }
+
+  private:
+    std::shared_ptr<NDetail::CancellationSourceOwner> iOwnerPtr;
+  };
+
+} // namespace NPromise
+
+#endif // PROMISE_CANCELLATION_H
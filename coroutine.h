@@ -0,0 +1,157 @@
+#ifndef PROMISE_COROUTINE_H
+#define PROMISE_COROUTINE_H
+
+#include <coroutine>
+#include <exception>
+#include <type_traits>
+#include <utility>
+
+#include "promise.h"
+
+/*
+   C++20 coroutine support for Promise (requires -std=c++20)
+
+     co_await promise
+        suspends the coroutine without blocking a thread until promise settles, then returns its result or throws its reason
+        does not suspend at all if promise has already settled
+        co_await on an rvalue (std::move(p), or a call returning a Promise) moves the result out, see TakeResult();
+        co_await on an lvalue copies it, and does not compile for results that cannot be copied
+     Promise<T> as coroutine return type
+        the coroutine runs on the calling thread up to its first co_await on a pending promise
+        it is resumed on its scheduler: the first Executor& parameter of the coroutine, GetDefaultExecutor() otherwise
+        co_return value fulfills the returned Promise, an exception escaping the body rejects it
+ */
+
+namespace NPromise {
+
+  namespace NDetail {
+    struct CoroutinePromiseBase
+    {
+      Executor* iScheduler;
+
+      template<typename... taArgs>
+      static Executor* FindScheduler(taArgs&... aArgs)
+      {
+        Executor* scheduler = nullptr;
+        ((scheduler = scheduler ? scheduler : AsExecutor(aArgs)), ...);
+        return scheduler ? scheduler : &GetDefaultExecutor();
+      }
+
+    private:
+      template<typename taArg>
+      static Executor* AsExecutor(taArg& aArg)
+      {
+        if constexpr (std::is_base_of<Executor, taArg>::value)
+          return &aArg;
+        else
+          return nullptr;
+      }
+    };
+
+    template<typename taResolvedType>
+    struct CoroutinePromise : public CoroutinePromiseBase
+    {
+      // Handed to the caller by get_return_object(); the coroutine settles it through iStatePtr, which does not count as
+      // a reader, so a caller that is the only reader left can move the result out
+      Promise<taResolvedType> iPromise;
+      StatePtr<taResolvedType> iStatePtr;
+
+      template<typename... taArgs>
+      explicit CoroutinePromise(taArgs&... aArgs)
+        : CoroutinePromiseBase{FindScheduler(aArgs...)}, iPromise(PromiseAccess::MakePending<taResolvedType>(iScheduler)),
+          iStatePtr(PromiseAccess::GetState(iPromise))
+      {
+      }
+
+      Promise<taResolvedType> get_return_object() { return std::move(iPromise); }
+
+      std::suspend_never initial_suspend() noexcept { return {}; }
+
+      // Nothing resumes a finished coroutine: the frame is destroyed right away
+      std::suspend_never final_suspend() noexcept { return {}; }
+
+      template<typename taValue>
+      void return_value(taValue&& aValue)
+      {
+        iStatePtr->Resolve(std::forward<taValue>(aValue));
+      }
+
+      void unhandled_exception()
+      {
+        iStatePtr->Reject(std::current_exception());
+      }
+    };
+
+    // Keeps a handle to the awaited promise; taConsume for co_await on an rvalue, which may move the result out
+    template<typename taResolvedType, bool taConsume>
+    class PromiseAwaiter
+    {
+    public:
+      explicit PromiseAwaiter(Promise<taResolvedType> aPromise)
+        : iPromise(std::move(aPromise))
+      {
+      }
+
+      bool await_ready() const
+      {
+        return State().IsSettled();
+      }
+
+      // Resumes on the scheduler of a Promise coroutine, on the scheduler of the awaited promise for other coroutine types
+      template<typename taCoroutinePromise>
+      void await_suspend(std::coroutine_handle<taCoroutinePromise> aHandle)
+      {
+        Executor* scheduler = State().iScheduler;
+        if constexpr (std::is_base_of<CoroutinePromiseBase, taCoroutinePromise>::value)
+          scheduler = aHandle.promise().iScheduler;
+
+        // Reads nothing: await_resume() reads through iPromise
+        State().AddContinuation(scheduler, [aHandle]() { aHandle.resume(); }, PromiseStateHolder<void>::Reader::NONE);
+      }
+
+      taResolvedType await_resume()
+      {
+        PromiseStateHolder<taResolvedType>& state = State();
+        if (state.GetState() == PromiseState::REJECTED)
+          std::rethrow_exception(state.iReason);
+        if constexpr (taConsume)
+          return PromiseAccess::TakeFrom(state);
+        else
+        {
+          static_assert(std::is_copy_constructible<taResolvedType>::value,
+                        "the result cannot be copied out of a promise that stays readable: co_await std::move(promise)");
+          return state.iResult;
+        }
+      }
+
+    private:
+      PromiseStateHolder<taResolvedType>& State() const
+      {
+        return *PromiseAccess::GetState(iPromise);
+      }
+
+      Promise<taResolvedType> iPromise;
+    };
+  }
+
+  template<typename taResolvedType>
+  NDetail::PromiseAwaiter<taResolvedType, false> operator co_await(const Promise<taResolvedType>& aPromise)
+  {
+    return NDetail::PromiseAwaiter<taResolvedType, false>(aPromise);
+  }
+
+  template<typename taResolvedType>
+  NDetail::PromiseAwaiter<taResolvedType, true> operator co_await(Promise<taResolvedType>&& aPromise)
+  {
+    return NDetail::PromiseAwaiter<taResolvedType, true>(std::move(aPromise));
+  }
+
+} // namespace NPromise
+
+template<typename taResolvedType, typename... taArgs>
+struct std::coroutine_traits<NPromise::Promise<taResolvedType>, taArgs...>
+{
+  typedef NPromise::NDetail::CoroutinePromise<taResolvedType> promise_type;
+};
+
+#endif // PROMISE_COROUTINE_H
@@ -0,0 +1,529 @@
+#ifndef PROMISE_EXECUTOR_H
+#define PROMISE_EXECUTOR_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "function.h"
+#include "metrics.h"
+
+/*
+   class Executor: abstract scheduler that Promise executors and then() handlers are posted to
+
+     Post()
+        queues a task for execution; must not block on the task itself
+     PostBatch()
+        queues several tasks at once, in order (see SettleBatch in promise.h); the tasks are moved from.
+        By default one Post() per task; the executors below take their queue lock and wake their threads once per batch
+     The executor must outlive every Promise that was created on it.
+
+   class ThreadPoolExecutor: fixed number of worker threads sharing one FIFO queue
+
+   class WorkStealingExecutor: worker threads with a local FIFO queue each
+      a task posted from one of its workers (a then() continuation settled there, say) goes to the "run next" slot of
+      that worker and runs right after the current task, on the same thread; the task it replaces moves to the local queue
+      tasks posted from other threads go to a shared queue; idle workers take from it and steal from the other workers
+      a worker that blocks in Wait() on a promise first moves its run next task to the front of its local queue and wakes
+      an idle worker to steal it, so waiting for a promise settled by that very task does not hang
+      a run next task left waiting behind a long task is taken by an idle worker once it has waited
+      PROMISE_STEAL_DELAY_US; a task that settles a promise and keeps computing does not hold its continuation back
+
+   class InlineExecutor: runs every task right away on the posting thread, see GetInlineExecutor()
+      for promise executors that settle without waiting (cache hits) and for short handlers;
+      a handler attached to a pending promise then runs on the thread that settles it, and a long chain of such
+      handlers settles recursively
+
+   GetDefaultExecutor()/SetDefaultExecutor()
+      process-wide executor used when no executor is passed to Promise, then() or All()
+ */
+
+#ifndef PROMISE_DEFAULT_THREAD_COUNT
+#define PROMISE_DEFAULT_THREAD_COUNT 0 // 0: one thread per hardware thread
+#endif
+
+#ifndef PROMISE_STEAL_DELAY_US
+#define PROMISE_STEAL_DELAY_US 50
+#endif
+
+namespace NPromise {
+
+  class Executor
+  {
+  public:
+    typedef Function<void(), PROMISE_TASK_CAPACITY> TTask;
+
+    virtual ~Executor() {}
+
+    virtual void Post(TTask aTask) = 0;
+
+    virtual void PostBatch(TTask* aTasks, std::size_t aCount)
+    {
+      for (std::size_t i = 0; i < aCount; ++i)
+        Post(std::move(aTasks[i]));
+    }
+  };
+
+  namespace NDetail {
+    // Wakes one thread per posted task, all of them once the batch is at least as large as the pool
+    inline void NotifyBatch(std::condition_variable& aConditionVariable, std::size_t aCount, std::size_t aThreadCount)
+    {
+      if (aCount >= aThreadCount)
+        aConditionVariable.notify_all();
+      else
+        for (std::size_t i = 0; i < aCount; ++i)
+          aConditionVariable.notify_one();
+    }
+  }
+
+  class ThreadPoolExecutor : public Executor
+  {
+  public:
+    explicit ThreadPoolExecutor(std::size_t aThreadCount = 0)
+      : iStopping(false)
+    {
+      if (aThreadCount == 0)
+        aThreadCount = std::max(1u, std::thread::hardware_concurrency());
+
+      iThreads.reserve(aThreadCount);
+      for (std::size_t i = 0; i < aThreadCount; ++i)
+        iThreads.emplace_back([this](){ Run(); });
+    }
+
+    ThreadPoolExecutor(const ThreadPoolExecutor&) = delete;
+    ThreadPoolExecutor& operator=(const ThreadPoolExecutor&) = delete;
+
+    // Runs every task that was already posted, then joins the workers
+    ~ThreadPoolExecutor()
+    {
+      {
+        std::lock_guard<std::mutex> l(iMutex);
+        iStopping = true;
+      }
+      iConditionVariable.notify_all();
+      for (std::thread& t : iThreads)
+        t.join();
+    }
+
+    void Post(TTask aTask) override
+    {
+      NDetail::CountMetric(NDetail::MetricsCounter::TASKS_POSTED);
+      {
+        std::lock_guard<std::mutex> l(iMutex);
+        iTasks.push_back(std::move(aTask));
+      }
+      iConditionVariable.notify_one();
+    }
+
+    void PostBatch(TTask* aTasks, std::size_t aCount) override
+    {
+      NDetail::CountMetric(NDetail::MetricsCounter::TASKS_POSTED, aCount);
+      {
+        std::lock_guard<std::mutex> l(iMutex);
+        for (std::size_t i = 0; i < aCount; ++i)
+          iTasks.push_back(std::move(aTasks[i]));
+      }
+      NDetail::NotifyBatch(iConditionVariable, aCount, iThreads.size());
+    }
+
+    std::size_t GetThreadCount() const { return iThreads.size(); }
+
+  private:
+    void Run()
+    {
+      NDetail::CountMetric(NDetail::MetricsCounter::THREADS_STARTED);
+      for (;;)
+      {
+        std::unique_lock<std::mutex> l(iMutex);
+        iConditionVariable.wait(l, [this](){ return iStopping || !iTasks.empty(); });
+        if (iTasks.empty())
+        {
+          NDetail::CountMetric(NDetail::MetricsCounter::THREADS_EXITED);
+          return;
+        }
+
+        TTask task = std::move(iTasks.front());
+        iTasks.pop_front();
+        l.unlock();
+        NDetail::CountMetric(NDetail::MetricsCounter::TASKS_STARTED);
+        task();
+      }
+    }
+
+    std::mutex iMutex;
+    std::condition_variable iConditionVariable;
+    std::deque<TTask> iTasks;
+    bool iStopping;
+    std::vector<std::thread> iThreads;
+  };
+
+  class WorkStealingExecutor : public Executor
+  {
+  public:
+    explicit WorkStealingExecutor(std::size_t aThreadCount = 0)
+      : iStopping(false), iSleeping(0), iWatching(0)
+    {
+      if (aThreadCount == 0)
+        aThreadCount = std::max(1u, std::thread::hardware_concurrency());
+
+      for (std::size_t i = 0; i < aThreadCount; ++i)
+        iWorkers.emplace_back(new Worker);
+      iThreads.reserve(aThreadCount);
+      for (std::size_t i = 0; i < aThreadCount; ++i)
+        iThreads.emplace_back([this, i](){ Run(i); });
+    }
+
+    WorkStealingExecutor(const WorkStealingExecutor&) = delete;
+    WorkStealingExecutor& operator=(const WorkStealingExecutor&) = delete;
+
+    // Runs every task that was already posted, then joins the workers
+    ~WorkStealingExecutor()
+    {
+      {
+        std::lock_guard<std::mutex> l(iMutex);
+        iStopping = true;
+      }
+      iConditionVariable.notify_all();
+      for (std::thread& t : iThreads)
+        t.join();
+    }
+
+    void Post(TTask aTask) override
+    {
+      NDetail::CountMetric(NDetail::MetricsCounter::TASKS_POSTED);
+      Worker* worker = CurrentWorker();
+      if (!worker)
+      {
+        {
+          std::lock_guard<std::mutex> l(iMutex);
+          iTasks.push_back(std::move(aTask));
+        }
+        iConditionVariable.notify_one();
+        return;
+      }
+
+      bool queued;
+      {
+        std::lock_guard<std::mutex> l(worker->iMutex);
+        queued = static_cast<bool>(worker->iRunNext);
+        if (queued)
+          worker->iTasks.push_back(std::move(worker->iRunNext));
+        worker->iRunNext = std::move(aTask);
+      }
+      // Read-modify-write pairs with the increment in Sleep(): either the sleeper sees the task or this sees the sleeper.
+      // A task in the run next slot only needs one sleeper watching the slots, see Sleep()
+      if (iSleeping.fetch_add(0, std::memory_order_acq_rel) > 0 &&
+          (queued || iWatching.load(std::memory_order_acquire) == 0))
+      {
+        std::lock_guard<std::mutex> l(iMutex);
+        iConditionVariable.notify_one();
+      }
+    }
+
+    // Same placement as aCount Post() calls, with one lock of each queue involved
+    void PostBatch(TTask* aTasks, std::size_t aCount) override
+    {
+      if (aCount == 0)
+        return;
+
+      Worker* worker = CurrentWorker();
+      if (!worker)
+      {
+        NDetail::CountMetric(NDetail::MetricsCounter::TASKS_POSTED, aCount);
+        {
+          std::lock_guard<std::mutex> l(iMutex);
+          for (std::size_t i = 0; i < aCount; ++i)
+            iTasks.push_back(std::move(aTasks[i]));
+        }
+        NDetail::NotifyBatch(iConditionVariable, aCount, iThreads.size());
+        return;
+      }
+
+      if (aCount == 1)
+      {
+        Post(std::move(aTasks[0]));
+        return;
+      }
+
+      NDetail::CountMetric(NDetail::MetricsCounter::TASKS_POSTED, aCount);
+
+      {
+        std::lock_guard<std::mutex> l(worker->iMutex);
+        if (worker->iRunNext)
+          worker->iTasks.push_back(std::move(worker->iRunNext));
+        for (std::size_t i = 0; i + 1 < aCount; ++i)
+          worker->iTasks.push_back(std::move(aTasks[i]));
+        worker->iRunNext = std::move(aTasks[aCount - 1]);
+      }
+      if (iSleeping.fetch_add(0, std::memory_order_acq_rel) > 0)
+      {
+        std::lock_guard<std::mutex> l(iMutex);
+        iConditionVariable.notify_all();
+      }
+    }
+
+    std::size_t GetThreadCount() const { return iThreads.size(); }
+
+    // See NDetail::BeforeBlocking()
+    static void BeforeBlocking()
+    {
+      CurrentWorkerSlot& slot = CurrentWorkerOfThread();
+      if (slot.iWorker)
+        slot.iExecutor->ShareTasks(*slot.iWorker);
+    }
+
+  private:
+    struct Worker
+    {
+      std::mutex iMutex;
+      std::deque<TTask> iTasks;
+      TTask iRunNext;
+      std::size_t iPasses = 0; // times the worker looked for its next task; unchanged while it runs one task
+    };
+
+    static constexpr std::size_t NOT_SEEN = static_cast<std::size_t>(-1);
+
+    struct CurrentWorkerSlot
+    {
+      WorkStealingExecutor* iExecutor;
+      Worker* iWorker;
+    };
+
+    static CurrentWorkerSlot& CurrentWorkerOfThread()
+    {
+      static thread_local CurrentWorkerSlot slot = { nullptr, nullptr };
+      return slot;
+    }
+
+    Worker* CurrentWorker() const
+    {
+      CurrentWorkerSlot& slot = CurrentWorkerOfThread();
+      return slot.iExecutor == this ? slot.iWorker : nullptr;
+    }
+
+    static bool PopFront(Worker& aWorker, TTask& aTask)
+    {
+      std::lock_guard<std::mutex> l(aWorker.iMutex);
+      if (aWorker.iTasks.empty())
+        return false;
+      aTask = std::move(aWorker.iTasks.front());
+      aWorker.iTasks.pop_front();
+      return true;
+    }
+
+    // Called by the worker itself before it blocks: nothing it kept for itself would run until it wakes up again,
+    // so its run next task becomes stealable (still first in line for the worker) and an idle worker comes for it
+    void ShareTasks(Worker& aWorker)
+    {
+      bool hasTasks;
+      {
+        std::lock_guard<std::mutex> l(aWorker.iMutex);
+        if (aWorker.iRunNext)
+        {
+          aWorker.iTasks.push_front(std::move(aWorker.iRunNext));
+          aWorker.iRunNext = nullptr;
+        }
+        hasTasks = !aWorker.iTasks.empty();
+      }
+      if (hasTasks && iSleeping.fetch_add(0, std::memory_order_acq_rel) > 0)
+      {
+        std::lock_guard<std::mutex> l(iMutex);
+        iConditionVariable.notify_one();
+      }
+    }
+
+    // Run next slot, own queue, shared queue, then the queues of the other workers
+    bool Next(std::size_t aIndex, TTask& aTask)
+    {
+      Worker& worker = *iWorkers[aIndex];
+      {
+        std::lock_guard<std::mutex> l(worker.iMutex);
+        ++worker.iPasses;
+        if (worker.iRunNext)
+        {
+          aTask = std::move(worker.iRunNext);
+          worker.iRunNext = nullptr;
+          return true;
+        }
+        if (!worker.iTasks.empty())
+        {
+          aTask = std::move(worker.iTasks.front());
+          worker.iTasks.pop_front();
+          return true;
+        }
+      }
+
+      {
+        std::lock_guard<std::mutex> l(iMutex);
+        if (!iTasks.empty())
+        {
+          aTask = std::move(iTasks.front());
+          iTasks.pop_front();
+          return true;
+        }
+      }
+
+      for (std::size_t i = 1; i < iWorkers.size(); ++i)
+        if (PopFront(*iWorkers[(aIndex + i) % iWorkers.size()], aTask))
+          return true;
+      return false;
+    }
+
+    // Takes the run next task of another worker that has not looked for a task since the previous call saw it there,
+    // that is one that has been busy with a single task for at least one wait of Sleep() in between
+    bool StealRunNext(std::size_t aIndex, std::vector<std::size_t>& aSeen, TTask& aTask)
+    {
+      for (std::size_t i = 1; i < iWorkers.size(); ++i)
+      {
+        std::size_t victim = (aIndex + i) % iWorkers.size();
+        Worker& worker = *iWorkers[victim];
+        std::lock_guard<std::mutex> l(worker.iMutex);
+        if (!worker.iRunNext)
+          aSeen[victim] = NOT_SEEN;
+        else if (aSeen[victim] != worker.iPasses)
+          aSeen[victim] = worker.iPasses;
+        else
+        {
+          aTask = std::move(worker.iRunNext);
+          worker.iRunNext = nullptr;
+          aSeen[victim] = NOT_SEEN;
+          return true;
+        }
+      }
+      return false;
+    }
+
+    bool HasLocalTasks(bool& aHasRunNext)
+    {
+      for (const std::unique_ptr<Worker>& worker : iWorkers)
+      {
+        std::lock_guard<std::mutex> l(worker->iMutex);
+        if (!worker->iTasks.empty())
+          return true;
+        aHasRunNext = aHasRunNext || worker->iRunNext;
+      }
+      return false;
+    }
+
+    // Waits for work; false once stopping and every queue is empty.
+    // While some worker has a run next task one sleeper is watching: it only waits PROMISE_STEAL_DELAY_US, so that
+    // StealRunNext() gets to run again. Post() wakes a sleeper for a run next task only when nobody is watching;
+    // iWatching drops before the watcher looks at the slots again, so either it sees the task or Post() sees it gone
+    bool Sleep()
+    {
+      std::unique_lock<std::mutex> l(iMutex);
+      for (;;)
+      {
+        if (!iTasks.empty())
+          return true;
+
+        iSleeping.fetch_add(1, std::memory_order_acq_rel);
+        bool hasRunNext = false;
+        bool hasLocalTasks = HasLocalTasks(hasRunNext);
+        if (hasLocalTasks || iStopping)
+        {
+          iSleeping.fetch_sub(1, std::memory_order_relaxed);
+          return hasLocalTasks;
+        }
+        if (hasRunNext && iWatching.load(std::memory_order_relaxed) == 0)
+        {
+          iWatching.fetch_add(1, std::memory_order_acq_rel);
+          iConditionVariable.wait_for(l, std::chrono::microseconds(PROMISE_STEAL_DELAY_US));
+          iWatching.fetch_sub(1, std::memory_order_acq_rel);
+          iSleeping.fetch_sub(1, std::memory_order_relaxed);
+          return true;
+        }
+        iConditionVariable.wait(l);
+        iSleeping.fetch_sub(1, std::memory_order_relaxed);
+      }
+    }
+
+    void Run(std::size_t aIndex)
+    {
+      CurrentWorkerOfThread() = CurrentWorkerSlot{this, iWorkers[aIndex].get()};
+      NDetail::CountMetric(NDetail::MetricsCounter::THREADS_STARTED);
+      std::vector<std::size_t> seen(iWorkers.size(), NOT_SEEN);
+      TTask task;
+      for (;;)
+      {
+        if (Next(aIndex, task) || StealRunNext(aIndex, seen, task))
+        {
+          NDetail::CountMetric(NDetail::MetricsCounter::TASKS_STARTED);
+          task();
+          task = nullptr;
+        }
+        else if (!Sleep())
+        {
+          NDetail::CountMetric(NDetail::MetricsCounter::THREADS_EXITED);
+          return;
+        }
+      }
+    }
+
+    std::mutex iMutex;
+    std::condition_variable iConditionVariable;
+    std::deque<TTask> iTasks;
+    bool iStopping;
+    std::atomic<std::size_t> iSleeping;
+    std::atomic<std::size_t> iWatching;
+    std::vector<std::unique_ptr<Worker>> iWorkers;
+    std::vector<std::thread> iThreads;
+  };
+
+  class InlineExecutor : public Executor
+  {
+  public:
+    void Post(TTask aTask) override
+    {
+      aTask();
+    }
+  };
+
+  inline Executor& GetInlineExecutor()
+  {
+    static InlineExecutor executor;
+    return executor;
+  }
+
+  namespace NDetail {
+    // Called on the current thread right before it blocks waiting for a promise (see Wait() in promise.h):
+    // lets the executor it is a worker of hand the tasks it kept for this thread to other threads
+    inline void BeforeBlocking()
+    {
+      WorkStealingExecutor::BeforeBlocking();
+    }
+  }
+
+  namespace NDetail {
+    inline std::atomic<Executor*>& DefaultExecutorOverride()
+    {
+      static std::atomic<Executor*> executor(nullptr);
+      return executor;
+    }
+  }
+
+  inline Executor& GetDefaultExecutor()
+  {
+    Executor* executor = NDetail::DefaultExecutorOverride().load(std::memory_order_acquire);
+    if (executor)
+      return *executor;
+
+    static ThreadPoolExecutor pool(PROMISE_DEFAULT_THREAD_COUNT);
+    return pool;
+  }
+
+  // aExecutor must outlive every Promise created while it is the default
+  inline void SetDefaultExecutor(Executor& aExecutor)
+  {
+    NDetail::DefaultExecutorOverride().store(&aExecutor, std::memory_order_release);
+  }
+
+} // namespace NPromise
+
+#endif // PROMISE_EXECUTOR_H
@@ -0,0 +1,195 @@
+#ifndef PROMISE_FUNCTION_H
+#define PROMISE_FUNCTION_H
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/*
+   template class Function: move-only replacement for std::function
+
+     Callables of at most taCapacity bytes that can be moved without throwing are stored inline, larger ones on the heap.
+     taCapacity defaults to PROMISE_FUNCTION_CAPACITY, which can be set at compile time.
+     Executor tasks (Executor::TTask) use PROMISE_TASK_CAPACITY: room for a Function of the default capacity plus a
+     pointer, the task that runs a promise executor, or two std::function handlers plus two pointers, a then() task.
+     Like std::function, operator() is const but calls the stored callable as non-const lvalue, so mutable lambdas work.
+ */
+
+#ifndef PROMISE_FUNCTION_CAPACITY
+#define PROMISE_FUNCTION_CAPACITY 64
+#endif
+
+#ifndef PROMISE_TASK_CAPACITY
+#define PROMISE_TASK_CAPACITY (PROMISE_FUNCTION_CAPACITY + 32)
+#endif
+
+namespace NPromise {
+
+  template<typename taSignature, std::size_t taCapacity = PROMISE_FUNCTION_CAPACITY>
+  class Function;
+
+  template<typename taResult, typename... taArgs, std::size_t taCapacity>
+  class Function<taResult(taArgs...), taCapacity>
+  {
+  public:
+    Function() noexcept
+      : iVTable(nullptr)
+    {
+    }
+
+    Function(std::nullptr_t) noexcept
+      : iVTable(nullptr)
+    {
+    }
+
+    template<typename taCallable,
+             typename = std::enable_if_t<!std::is_same<std::decay_t<taCallable>, Function>::value &&
+                                         std::is_invocable_r<taResult, std::decay_t<taCallable>&, taArgs...>::value>>
+    Function(taCallable&& aCallable)
+      : iVTable(nullptr)
+    {
+      typedef std::decay_t<taCallable> TCallable;
+      if (IsEmpty(aCallable))
+        return;
+
+      if constexpr (IsInline<TCallable>())
+        new (&iStorage) TCallable(std::forward<taCallable>(aCallable));
+      else
+        new (&iStorage) TCallable*(new TCallable(std::forward<taCallable>(aCallable)));
+      iVTable = &VTableFor<TCallable>::iVTable;
+    }
+
+    Function(Function&& aOther) noexcept
+      : iVTable(aOther.iVTable)
+    {
+      if (iVTable)
+      {
+        iVTable->iMove(&iStorage, &aOther.iStorage);
+        aOther.iVTable = nullptr;
+      }
+    }
+
+    Function& operator=(Function&& aOther) noexcept
+    {
+      if (this == &aOther)
+        return *this;
+
+      Reset();
+      if (aOther.iVTable)
+      {
+        iVTable = aOther.iVTable;
+        iVTable->iMove(&iStorage, &aOther.iStorage);
+        aOther.iVTable = nullptr;
+      }
+      return *this;
+    }
+
+    Function& operator=(std::nullptr_t) noexcept
+    {
+      Reset();
+      return *this;
+    }
+
+    Function(const Function&) = delete;
+    Function& operator=(const Function&) = delete;
+
+    ~Function()
+    {
+      Reset();
+    }
+
+    taResult operator()(taArgs... aArgs) const
+    {
+      if (!iVTable)
+        throw std::bad_function_call();
+      return iVTable->iInvoke(const_cast<Storage*>(&iStorage), std::forward<taArgs>(aArgs)...);
+    }
+
+    explicit operator bool() const noexcept { return iVTable != nullptr; }
+
+  private:
+    typedef std::aligned_storage_t<taCapacity, alignof(std::max_align_t)> Storage;
+
+    struct VTable
+    {
+      taResult (*iInvoke)(void*, taArgs&&...);
+      void (*iMove)(void*, void*);
+      void (*iDestroy)(void*);
+    };
+
+    template<typename taCallable>
+    static constexpr bool IsInline()
+    {
+      return sizeof(taCallable) <= taCapacity && alignof(taCallable) <= alignof(Storage) &&
+             std::is_nothrow_move_constructible<taCallable>::value;
+    }
+
+    template<typename taCallable>
+    static taCallable& Target(void* aStorage)
+    {
+      if constexpr (IsInline<taCallable>())
+        return *static_cast<taCallable*>(aStorage);
+      else
+        return **static_cast<taCallable**>(aStorage);
+    }
+
+    template<typename taCallable>
+    struct VTableFor
+    {
+      static taResult Invoke(void* aStorage, taArgs&&... aArgs)
+      {
+        return std::invoke(Target<taCallable>(aStorage), std::forward<taArgs>(aArgs)...);
+      }
+
+      static void Move(void* aTo, void* aFrom)
+      {
+        if constexpr (IsInline<taCallable>())
+        {
+          new (aTo) taCallable(std::move(Target<taCallable>(aFrom)));
+          Target<taCallable>(aFrom).~taCallable();
+        }
+        else
+          new (aTo) taCallable*(*static_cast<taCallable**>(aFrom));
+      }
+
+      static void Destroy(void* aStorage)
+      {
+        if constexpr (IsInline<taCallable>())
+          Target<taCallable>(aStorage).~taCallable();
+        else
+          delete &Target<taCallable>(aStorage);
+      }
+
+      static constexpr VTable iVTable = { &Invoke, &Move, &Destroy };
+    };
+
+    // Empty std::function objects and null function pointers give an empty Function
+    template<typename taCallable>
+    static bool IsEmpty(const taCallable& aCallable)
+    {
+      if constexpr (std::is_pointer<taCallable>::value || std::is_member_pointer<taCallable>::value)
+        return aCallable == nullptr;
+      else if constexpr (std::is_constructible<bool, const taCallable&>::value)
+        return !static_cast<bool>(aCallable);
+      else
+        return false;
+    }
+
+    void Reset() noexcept
+    {
+      if (iVTable)
+      {
+        iVTable->iDestroy(&iStorage);
+        iVTable = nullptr;
+      }
+    }
+
+    Storage iStorage;
+    const VTable* iVTable;
+  };
+
+} // namespace NPromise
+
+#endif // PROMISE_FUNCTION_H
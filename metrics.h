@@ -0,0 +1,265 @@
+#ifndef PROMISE_METRICS_H
+#define PROMISE_METRICS_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+/*
+   Runtime metrics: compiled out unless PROMISE_METRICS is defined; GetMetrics() then returns an all-zero snapshot
+
+     GetMetrics(): MetricsSnapshot summed over every thread, to be scraped periodically
+        iCreated, iFulfilled, iRejected: promises since the start of the process
+        iLive: promise states not destroyed yet; iPending: live and not settled yet
+        iQueueDepth: tasks posted to a ThreadPoolExecutor or WorkStealingExecutor that did not start yet
+        iThreads: running threads of those executors and of the timer queue
+        iSettleLatency: histogram of the time from creating a promise to settling it
+        iContinuationDelay: histogram of the time from settling a promise to running a then()/Catch() handler on it
+
+     Every thread counts into its own block with plain relaxed stores, so counting takes no lock and shares no
+     cache line; GetMetrics() reads all blocks without stopping the threads, so the gauges it derives from
+     several counters are approximate while promises are being created and settled.
+     Reading the clock costs more than all counters together, so only one in PROMISE_METRICS_SAMPLE_INTERVAL promises,
+     picked at random so that regular patterns like promise/then() pairs do not skew it, is timed; the counts are exact,
+     the histograms hold the timed promises only.
+ */
+
+#ifndef PROMISE_METRICS_SAMPLE_INTERVAL
+#define PROMISE_METRICS_SAMPLE_INTERVAL 16 // 1: time every promise
+#endif
+
+namespace NPromise {
+
+  // Bucket i counts durations in [2^i, 2^(i+1)) nanoseconds; bucket 0 also counts 0, the last one everything longer
+  struct MetricsHistogram
+  {
+    static constexpr std::size_t kBucketCount = 40;
+
+    std::uint64_t iCounts[kBucketCount] = {};
+
+    std::uint64_t GetCount() const
+    {
+      std::uint64_t count = 0;
+      for (std::uint64_t c : iCounts)
+        count += c;
+      return count;
+    }
+
+    // Upper bound of the bucket holding the aFraction quantile (0.5 for the median); zero if the histogram is empty
+    std::chrono::nanoseconds GetQuantile(double aFraction) const
+    {
+      std::uint64_t count = GetCount();
+      if (count == 0)
+        return std::chrono::nanoseconds(0);
+      std::uint64_t rank = std::uint64_t(aFraction * double(count - 1));
+      std::uint64_t seen = 0;
+      for (std::size_t i = 0; i < kBucketCount; ++i)
+      {
+        seen += iCounts[i];
+        if (seen > rank)
+          return std::chrono::nanoseconds((std::int64_t(1) << (i + 1)) - 1);
+      }
+      return std::chrono::nanoseconds((std::int64_t(1) << kBucketCount) - 1);
+    }
+  };
+
+  struct MetricsSnapshot
+  {
+    std::uint64_t iCreated = 0;
+    std::uint64_t iFulfilled = 0;
+    std::uint64_t iRejected = 0;
+    std::int64_t iLive = 0;
+    std::int64_t iPending = 0;
+    std::int64_t iQueueDepth = 0;
+    std::int64_t iThreads = 0;
+    MetricsHistogram iSettleLatency;
+    MetricsHistogram iContinuationDelay;
+  };
+
+  namespace NDetail {
+    enum class MetricsCounter
+    {
+      CREATED = 0, DESTROYED, DESTROYED_PENDING, FULFILLED, REJECTED, TASKS_POSTED, TASKS_STARTED, THREADS_STARTED, THREADS_EXITED,
+      COUNT
+    };
+
+    // Written by its thread only, read by GetMetrics(); trivially destructible like the pool caches in allocator.h,
+    // so counts from thread_local destructors that run after MetricsThreadReleaser are harmless
+    struct MetricsBlock
+    {
+      std::atomic<std::uint64_t> iCounters[std::size_t(MetricsCounter::COUNT)];
+      std::atomic<std::uint64_t> iSettleLatency[MetricsHistogram::kBucketCount];
+      std::atomic<std::uint64_t> iContinuationDelay[MetricsHistogram::kBucketCount];
+      // State of the random generator that picks promises to time; not reported
+      std::uint32_t iSampleState;
+    };
+
+    class MetricsRegistry
+    {
+    public:
+      // Never destroyed: threads may still retire their blocks during static destruction
+      static MetricsRegistry& Get()
+      {
+        static MetricsRegistry* registry = new MetricsRegistry;
+        return *registry;
+      }
+
+      void Add(MetricsBlock& aBlock)
+      {
+        std::lock_guard<std::mutex> l(iMutex);
+        iBlocks.push_back(&aBlock);
+      }
+
+      // Keeps the counts of an exiting thread
+      void Retire(MetricsBlock& aBlock)
+      {
+        std::lock_guard<std::mutex> l(iMutex);
+        iBlocks.erase(std::remove(iBlocks.begin(), iBlocks.end(), &aBlock), iBlocks.end());
+        Add(iRetired, aBlock);
+      }
+
+      MetricsSnapshot GetSnapshot()
+      {
+        MetricsBlock total = {};
+        {
+          std::lock_guard<std::mutex> l(iMutex);
+          Add(total, iRetired);
+          for (MetricsBlock* block : iBlocks)
+            Add(total, *block);
+        }
+
+        auto count = [&total](MetricsCounter aCounter) { return total.iCounters[std::size_t(aCounter)].load(std::memory_order_relaxed); };
+        MetricsSnapshot snapshot;
+        snapshot.iCreated = count(MetricsCounter::CREATED);
+        snapshot.iFulfilled = count(MetricsCounter::FULFILLED);
+        snapshot.iRejected = count(MetricsCounter::REJECTED);
+        snapshot.iLive = std::max<std::int64_t>(0, std::int64_t(snapshot.iCreated - count(MetricsCounter::DESTROYED)));
+        snapshot.iPending = std::max<std::int64_t>(0, std::int64_t(snapshot.iCreated - snapshot.iFulfilled - snapshot.iRejected -
+                                                                   count(MetricsCounter::DESTROYED_PENDING)));
+        snapshot.iQueueDepth = std::max<std::int64_t>(0, std::int64_t(count(MetricsCounter::TASKS_POSTED) - count(MetricsCounter::TASKS_STARTED)));
+        snapshot.iThreads = std::max<std::int64_t>(0, std::int64_t(count(MetricsCounter::THREADS_STARTED) - count(MetricsCounter::THREADS_EXITED)));
+        for (std::size_t i = 0; i < MetricsHistogram::kBucketCount; ++i)
+        {
+          snapshot.iSettleLatency.iCounts[i] = total.iSettleLatency[i].load(std::memory_order_relaxed);
+          snapshot.iContinuationDelay.iCounts[i] = total.iContinuationDelay[i].load(std::memory_order_relaxed);
+        }
+        return snapshot;
+      }
+
+    private:
+      static void Add(MetricsBlock& aTotal, const MetricsBlock& aBlock)
+      {
+        for (std::size_t i = 0; i < std::size_t(MetricsCounter::COUNT); ++i)
+          aTotal.iCounters[i].fetch_add(aBlock.iCounters[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        for (std::size_t i = 0; i < MetricsHistogram::kBucketCount; ++i)
+        {
+          aTotal.iSettleLatency[i].fetch_add(aBlock.iSettleLatency[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+          aTotal.iContinuationDelay[i].fetch_add(aBlock.iContinuationDelay[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+      }
+
+      std::mutex iMutex;
+      std::vector<MetricsBlock*> iBlocks;
+      MetricsBlock iRetired = {};
+    };
+
+    struct MetricsThreadReleaser
+    {
+      MetricsBlock& iBlock;
+
+      explicit MetricsThreadReleaser(MetricsBlock& aBlock)
+        : iBlock(aBlock)
+      {
+        MetricsRegistry::Get().Add(iBlock);
+      }
+
+      ~MetricsThreadReleaser() { MetricsRegistry::Get().Retire(iBlock); }
+    };
+
+    inline MetricsBlock& ThreadMetrics()
+    {
+      static thread_local MetricsBlock block = {};
+      static thread_local MetricsThreadReleaser releaser(block);
+      (void)releaser;
+      return block;
+    }
+
+    // Only the owning thread writes, so a load and a store do instead of a locked read-modify-write
+    inline void Bump(std::atomic<std::uint64_t>& aCounter, std::uint64_t aCount)
+    {
+      aCounter.store(aCounter.load(std::memory_order_relaxed) + aCount, std::memory_order_relaxed);
+    }
+
+    inline void CountMetric(MetricsCounter aCounter, std::uint64_t aCount = 1)
+    {
+#ifdef PROMISE_METRICS
+      Bump(ThreadMetrics().iCounters[std::size_t(aCounter)], aCount);
+#else
+      (void)aCounter;
+      (void)aCount;
+#endif
+    }
+
+    // True for one in PROMISE_METRICS_SAMPLE_INTERVAL calls on average (xorshift32)
+    inline bool SampleLatency()
+    {
+#ifdef PROMISE_METRICS
+      std::uint32_t& x = ThreadMetrics().iSampleState;
+      if (x == 0)
+        x = 0x9e3779b9u;
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      return x % PROMISE_METRICS_SAMPLE_INTERVAL == 0;
+#else
+      return false;
+#endif
+    }
+
+    inline std::size_t MetricsBucket(std::chrono::steady_clock::duration aDuration)
+    {
+      std::uint64_t ns = std::uint64_t(std::max<std::int64_t>(0, std::chrono::duration_cast<std::chrono::nanoseconds>(aDuration).count()));
+      std::size_t bucket = 0;
+      while (ns > 1 && bucket + 1 < MetricsHistogram::kBucketCount)
+      {
+        ns >>= 1;
+        ++bucket;
+      }
+      return bucket;
+    }
+
+    inline void RecordSettleLatency(std::chrono::steady_clock::duration aDuration)
+    {
+#ifdef PROMISE_METRICS
+      Bump(ThreadMetrics().iSettleLatency[MetricsBucket(aDuration)], 1);
+#else
+      (void)aDuration;
+#endif
+    }
+
+    inline void RecordContinuationDelay(std::chrono::steady_clock::duration aDuration)
+    {
+#ifdef PROMISE_METRICS
+      Bump(ThreadMetrics().iContinuationDelay[MetricsBucket(aDuration)], 1);
+#else
+      (void)aDuration;
+#endif
+    }
+  }
+
+  inline MetricsSnapshot GetMetrics()
+  {
+#ifdef PROMISE_METRICS
+    return NDetail::MetricsRegistry::Get().GetSnapshot();
+#else
+    return MetricsSnapshot();
+#endif
+  }
+
+} // namespace NPromise
+
+#endif // PROMISE_METRICS_H
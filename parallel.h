@@ -0,0 +1,332 @@
+#ifndef PROMISE_PARALLEL_H
+#define PROMISE_PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "promise.h"
+
+/*
+   Data parallel algorithms returning a Promise; the work runs on the scheduler (GetDefaultExecutor() by default)
+
+     ParallelFor(begin, end, grain, f): calls f(element) for every element, grain elements per chunk;
+        fulfills with the number of elements
+     Map(begin, end, f): Promise<std::vector<R>> of f(element), in the order of the range
+     MapReduce(begin, end, map, reduce): reduce(reduce(map(a), map(b)), ...) over the range; reduce must be associative
+        and commutative, as partial results are combined in the order the chunks complete. An empty range fulfills
+        with a default constructed value (rejects with std::invalid_argument if there is none)
+     Each also takes a range (a container) instead of begin and end, and an optional CancellationToken and scheduler last.
+
+   The range is given by random access iterators or by two integers, in which case f gets the index.
+   It is split in chunks of grain elements (Map and MapReduce, and a grain of 0: about PROMISE_PARALLEL_CHUNK_BYTES of
+   elements, at least PROMISE_PARALLEL_CHUNKS_PER_THREAD chunks per hardware thread), taken one at a time by at most
+   one task per hardware thread, so fast threads take more chunks.
+   The handlers run concurrently on several threads.
+   A handler that throws rejects with that exception and cancelling the token rejects with CancelledError;
+   either way the chunks that did not start yet are skipped, and the promise settles once the running ones returned,
+   so the range must stay valid until then.
+ */
+
+#ifndef PROMISE_PARALLEL_CHUNK_BYTES
+#define PROMISE_PARALLEL_CHUNK_BYTES 16384 // half of a typical L1 data cache
+#endif
+
+#ifndef PROMISE_PARALLEL_CHUNKS_PER_THREAD
+#define PROMISE_PARALLEL_CHUNKS_PER_THREAD 4
+#endif
+
+namespace NPromise {
+
+  namespace NDetail {
+    // Runs aChunk(first, last) for the chunks of [0, aCount) on up to one task per hardware thread,
+    // then aDone(reason) once every chunk ran or was skipped; reason is null if all of them ran
+    template<typename taChunk, typename taDone>
+    class ChunkedJob : public std::enable_shared_from_this<ChunkedJob<taChunk, taDone>>
+    {
+    public:
+      ChunkedJob(std::size_t aCount, std::size_t aGrain, taChunk aChunk, taDone aDone, const CancellationToken& aToken)
+        : iCount(aCount), iGrain(aGrain), iChunkCount((aCount + aGrain - 1) / aGrain), iNext(0), iAccounted(0),
+          iFailing(false), iFailed(false), iSkipped(false), iChunk(std::move(aChunk)), iDone(std::move(aDone)), iToken(aToken)
+      {
+      }
+
+      void Start(Executor& aScheduler)
+      {
+        if (iChunkCount == 0)
+        {
+          iDone(nullptr);
+          return;
+        }
+
+        std::size_t taskCount = std::min<std::size_t>(iChunkCount, std::max(1u, std::thread::hardware_concurrency()));
+        std::vector<Executor::TTask> tasks;
+        tasks.reserve(taskCount);
+        for (std::size_t i = 0; i < taskCount; ++i)
+          tasks.push_back([self=this->shared_from_this()]() { self->Work(); });
+        aScheduler.PostBatch(tasks.data(), tasks.size());
+      }
+
+    private:
+      void Work()
+      {
+        for (;;)
+        {
+          if (iFailed.load(std::memory_order_acquire) || iToken.IsCancelled())
+          {
+            // Claims every chunk left at once, so the job completes without running them
+            std::size_t first = iNext.exchange(iChunkCount, std::memory_order_relaxed);
+            if (first < iChunkCount)
+            {
+              iSkipped.store(true, std::memory_order_relaxed);
+              Account(iChunkCount - first);
+            }
+            return;
+          }
+
+          std::size_t chunk = iNext.fetch_add(1, std::memory_order_relaxed);
+          if (chunk >= iChunkCount)
+            return;
+
+          std::size_t first = chunk * iGrain;
+          try
+          {
+            iChunk(first, std::min(first + iGrain, iCount));
+          }
+          catch(...)
+          {
+            bool expected = false;
+            if (iFailing.compare_exchange_strong(expected, true, std::memory_order_relaxed))
+            {
+              iReason = std::current_exception();
+              iFailed.store(true, std::memory_order_release);
+            }
+          }
+          Account(1);
+        }
+      }
+
+      void Account(std::size_t aChunkCount)
+      {
+        if (iAccounted.fetch_add(aChunkCount, std::memory_order_acq_rel) + aChunkCount != iChunkCount)
+          return;
+
+        if (iFailed.load(std::memory_order_acquire))
+          iDone(iReason);
+        else if (iSkipped.load(std::memory_order_relaxed))
+          iDone(std::make_exception_ptr(CancelledError()));
+        else
+          iDone(nullptr);
+      }
+
+      const std::size_t iCount;
+      const std::size_t iGrain;
+      const std::size_t iChunkCount;
+      std::atomic<std::size_t> iNext;      // next chunk to claim
+      std::atomic<std::size_t> iAccounted; // chunks that ran or were skipped
+      std::atomic<bool> iFailing;          // a handler threw; set by the first one only
+      std::atomic<bool> iFailed;           // iReason is written
+      std::atomic<bool> iSkipped;
+      std::exception_ptr iReason;
+      taChunk iChunk;
+      taDone iDone;
+      CancellationToken iToken;
+    };
+
+    template<typename taChunk, typename taDone>
+    void RunChunked(std::size_t aCount, std::size_t aGrain, taChunk&& aChunk, taDone&& aDone, const CancellationToken& aToken, Executor* aScheduler)
+    {
+      typedef ChunkedJob<std::decay_t<taChunk>, std::decay_t<taDone>> TJob;
+      std::make_shared<TJob>(aCount, std::max<std::size_t>(aGrain, 1), std::forward<taChunk>(aChunk), std::forward<taDone>(aDone), aToken)
+        ->Start(aScheduler ? *aScheduler : GetDefaultExecutor());
+    }
+
+    // Element aIndex of the range starting at aBegin: the index itself for integer ranges
+    template<typename taIterator>
+    decltype(auto) RangeElement(const taIterator& aBegin, std::size_t aIndex)
+    {
+      if constexpr (std::is_integral<taIterator>::value)
+        return static_cast<taIterator>(aBegin + aIndex);
+      else
+        return *(aBegin + aIndex);
+    }
+
+    template<typename taIterator>
+    std::size_t RangeSize(const taIterator& aBegin, const taIterator& aEnd)
+    {
+      if constexpr (std::is_integral<taIterator>::value)
+        return aEnd > aBegin ? std::size_t(aEnd - aBegin) : 0;
+      else
+      {
+        static_assert(std::is_base_of<std::random_access_iterator_tag, typename std::iterator_traits<taIterator>::iterator_category>::value,
+                      "parallel algorithms need random access iterators");
+        return std::size_t(std::distance(aBegin, aEnd));
+      }
+    }
+
+    template<typename taIterator>
+    using RangeReference = decltype(RangeElement(std::declval<const taIterator&>(), 0));
+
+    // Chunks of about PROMISE_PARALLEL_CHUNK_BYTES, but enough of them to keep every thread busy
+    template<typename taIterator>
+    std::size_t DefaultGrain(std::size_t aCount)
+    {
+      std::size_t cacheGrain = std::max<std::size_t>(1, PROMISE_PARALLEL_CHUNK_BYTES / sizeof(std::decay_t<RangeReference<taIterator>>));
+      std::size_t chunkCount = std::size_t(PROMISE_PARALLEL_CHUNKS_PER_THREAD) * std::max(1u, std::thread::hardware_concurrency());
+      return std::max<std::size_t>(1, std::min(cacheGrain, (aCount + chunkCount - 1) / chunkCount));
+    }
+
+    template<typename taRange, typename = void>
+    struct IsRange : std::false_type {};
+
+    template<typename taRange>
+    struct IsRange<taRange, std::void_t<decltype(std::begin(std::declval<taRange&>())), decltype(std::end(std::declval<taRange&>()))>> : std::true_type {};
+  }
+
+  template<typename taIterator, typename taFunction>
+  Promise<std::size_t> ParallelFor(taIterator aBegin, taIterator aEnd, std::size_t aGrain, taFunction&& aFunction,
+                                   const CancellationToken& aToken = CancellationToken(), Executor* aScheduler = nullptr)
+  {
+    std::size_t count = NDetail::RangeSize(aBegin, aEnd);
+    Promise<std::size_t> output = NDetail::PromiseAccess::MakePending<std::size_t>(aScheduler);
+    StatePtr<std::size_t> outputPtr = NDetail::PromiseAccess::GetState(output);
+
+    NDetail::RunChunked(count, aGrain ? aGrain : NDetail::DefaultGrain<taIterator>(count),
+      [aBegin, function=std::forward<taFunction>(aFunction)](std::size_t aFirst, std::size_t aLast) mutable
+      {
+        for (std::size_t i = aFirst; i < aLast; ++i)
+          std::invoke(function, NDetail::RangeElement(aBegin, i));
+      },
+      [outputPtr, count](std::exception_ptr aReason)
+      {
+        if (aReason)
+          outputPtr->Reject(aReason);
+        else
+          outputPtr->Resolve(count);
+      },
+      aToken, aScheduler);
+    return output;
+  }
+
+  template<typename taRange, typename taFunction, typename = std::enable_if_t<NDetail::IsRange<taRange>::value>>
+  Promise<std::size_t> ParallelFor(taRange& aRange, std::size_t aGrain, taFunction&& aFunction,
+                                   const CancellationToken& aToken = CancellationToken(), Executor* aScheduler = nullptr)
+  {
+    return ParallelFor(std::begin(aRange), std::end(aRange), aGrain, std::forward<taFunction>(aFunction), aToken, aScheduler);
+  }
+
+  template<typename taIterator, typename taFunction,
+           typename taResult = std::decay_t<std::invoke_result_t<std::decay_t<taFunction>&, NDetail::RangeReference<taIterator>>>>
+  Promise<std::vector<taResult>> Map(taIterator aBegin, taIterator aEnd, taFunction&& aFunction,
+                                     const CancellationToken& aToken = CancellationToken(), Executor* aScheduler = nullptr)
+  {
+    // Written in place by the chunks; slots are optional when taResult has no default constructor,
+    // and for bool, since the bits of a std::vector<bool> cannot be written from several threads
+    typedef std::conditional_t<std::is_default_constructible<taResult>::value && !std::is_same<taResult, bool>::value,
+                               taResult, std::optional<taResult>> TSlot;
+
+    std::size_t count = NDetail::RangeSize(aBegin, aEnd);
+    Promise<std::vector<taResult>> output = NDetail::PromiseAccess::MakePending<std::vector<taResult>>(aScheduler);
+    StatePtr<std::vector<taResult>> outputPtr = NDetail::PromiseAccess::GetState(output);
+    std::shared_ptr<std::vector<TSlot>> resultsPtr = std::make_shared<std::vector<TSlot>>(count);
+
+    NDetail::RunChunked(count, NDetail::DefaultGrain<taIterator>(count),
+      [aBegin, resultsPtr, function=std::forward<taFunction>(aFunction)](std::size_t aFirst, std::size_t aLast) mutable
+      {
+        for (std::size_t i = aFirst; i < aLast; ++i)
+          (*resultsPtr)[i] = std::invoke(function, NDetail::RangeElement(aBegin, i));
+      },
+      [outputPtr, resultsPtr](std::exception_ptr aReason)
+      {
+        if (aReason)
+        {
+          outputPtr->Reject(aReason);
+          return;
+        }
+        if constexpr (std::is_same<TSlot, taResult>::value)
+          outputPtr->Resolve(std::move(*resultsPtr));
+        else
+        {
+          std::vector<taResult> results;
+          results.reserve(resultsPtr->size());
+          for (std::optional<taResult>& result : *resultsPtr)
+            results.push_back(std::move(*result));
+          outputPtr->Resolve(std::move(results));
+        }
+      },
+      aToken, aScheduler);
+    return output;
+  }
+
+  template<typename taRange, typename taFunction, typename = std::enable_if_t<NDetail::IsRange<taRange>::value>>
+  auto Map(taRange& aRange, taFunction&& aFunction, const CancellationToken& aToken = CancellationToken(), Executor* aScheduler = nullptr)
+  {
+    return Map(std::begin(aRange), std::end(aRange), std::forward<taFunction>(aFunction), aToken, aScheduler);
+  }
+
+  template<typename taIterator, typename taMap, typename taReduce,
+           typename taResult = std::decay_t<std::invoke_result_t<std::decay_t<taMap>&, NDetail::RangeReference<taIterator>>>>
+  Promise<taResult> MapReduce(taIterator aBegin, taIterator aEnd, taMap&& aMap, taReduce&& aReduce,
+                              const CancellationToken& aToken = CancellationToken(), Executor* aScheduler = nullptr)
+  {
+    // Folded into by every chunk as it completes
+    struct Total
+    {
+      std::mutex iMutex;
+      std::optional<taResult> iValue;
+    };
+
+    std::size_t count = NDetail::RangeSize(aBegin, aEnd);
+    Promise<taResult> output = NDetail::PromiseAccess::MakePending<taResult>(aScheduler);
+    StatePtr<taResult> outputPtr = NDetail::PromiseAccess::GetState(output);
+    std::shared_ptr<Total> totalPtr = std::make_shared<Total>();
+    std::shared_ptr<std::decay_t<taReduce>> reducePtr = std::make_shared<std::decay_t<taReduce>>(std::forward<taReduce>(aReduce));
+
+    NDetail::RunChunked(count, NDetail::DefaultGrain<taIterator>(count),
+      [aBegin, totalPtr, reducePtr, map=std::forward<taMap>(aMap)](std::size_t aFirst, std::size_t aLast) mutable
+      {
+        taResult partial = std::invoke(map, NDetail::RangeElement(aBegin, aFirst));
+        for (std::size_t i = aFirst + 1; i < aLast; ++i)
+          partial = std::invoke(*reducePtr, std::move(partial), std::invoke(map, NDetail::RangeElement(aBegin, i)));
+
+        std::lock_guard<std::mutex> l(totalPtr->iMutex);
+        if (totalPtr->iValue)
+          totalPtr->iValue = std::invoke(*reducePtr, std::move(*totalPtr->iValue), std::move(partial));
+        else
+          totalPtr->iValue.emplace(std::move(partial));
+      },
+      [outputPtr, totalPtr](std::exception_ptr aReason)
+      {
+        if (aReason)
+          outputPtr->Reject(aReason);
+        else if (totalPtr->iValue)
+          outputPtr->Resolve(std::move(*totalPtr->iValue));
+        else if constexpr (std::is_default_constructible<taResult>::value)
+          outputPtr->Resolve(taResult());
+        else
+          outputPtr->Reject(std::make_exception_ptr(std::invalid_argument("MapReduce over an empty range")));
+      },
+      aToken, aScheduler);
+    return output;
+  }
+
+  template<typename taRange, typename taMap, typename taReduce, typename = std::enable_if_t<NDetail::IsRange<taRange>::value>>
+  auto MapReduce(taRange& aRange, taMap&& aMap, taReduce&& aReduce, const CancellationToken& aToken = CancellationToken(), Executor* aScheduler = nullptr)
+  {
+    return MapReduce(std::begin(aRange), std::end(aRange), std::forward<taMap>(aMap), std::forward<taReduce>(aReduce), aToken, aScheduler);
+  }
+
+} // namespace NPromise
+
+#endif // PROMISE_PARALLEL_H
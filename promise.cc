@@ -6,19 +6,19 @@
 
 using namespace NPromise;
 
-int main(int argc, char** argv)
+int main()
 {
-  Promise<int>::TExecutor e = [](Promise<int>::TResolver aResolver, Promise<int>::TRejecter aRejecter){ sleep(10); std::cout << "thread " << std::this_thread::get_id()<< " awake" << std::endl; aResolver(5);};
+  Promise<int>::TExecutor e = [](Promise<int>::TResolver aResolver, Promise<int>::TRejecter){ sleep(10); std::cout << "thread " << std::this_thread::get_id()<< " awake" << std::endl; aResolver(5);};
   Promise<int>::TExecutor e2 = [](Promise<int>::TResolver aResolver, Promise<int>::TRejecter){ sleep(11); std::cout << "thread " << std::this_thread::get_id() << " awake" << std::endl; aResolver(55);};
-  Promise<int> p(e);
-  std::function<void(const int&, Promise<double>::TResolver, Promise<double>::TRejecter)> resolveHandler = [](const int& aResult, Promise<double>::TResolver aResolver, Promise<double>::TRejecter aRejecter)
+  Promise<int> p(std::move(e));
+  std::function<void(const int&, Promise<double>::TResolver, Promise<double>::TRejecter)> resolveHandler = [](const int& aResult, Promise<double>::TResolver aResolver, Promise<double>::TRejecter)
            {
              std::cout << "Resolve handler" << std::endl;
              throw(13);
 	     aResolver(sqrt((double)aResult));
            };
 
-  std::function<void(const std::string&, Promise<double>::TResolver, Promise<double>::TRejecter)> rejectHandler = [](const std::string& aReason, Promise<double>::TResolver aResolver, Promise<double>::TRejecter aRejecter)
+  std::function<void(const std::exception_ptr&, Promise<double>::TResolver, Promise<double>::TRejecter)> rejectHandler = [](const std::exception_ptr&, Promise<double>::TResolver, Promise<double>::TRejecter aRejecter)
            {
 	     std::cout << "Reject handler" << std::endl;
              aRejecter("Original promise rejected");
@@ -26,14 +26,25 @@ int main(int argc, char** argv)
 
   auto p2 = p.then<double>(resolveHandler, rejectHandler);
   //Promise<int> p3(e2);
-  sleep(12);
+  p2.Wait();
   if (p2.isFulfilled())
   {
     std::cout << "Result: " << p2.GetResult() << std::endl;
   }
   else
   {
-    std::cout << "Rejected with reason: " << p2.GetReason() << std::endl;
+    try
+    {
+      std::rethrow_exception(p2.GetReason());
+    }
+    catch(int aCode)
+    {
+      std::cout << "Rejected with code: " << aCode << std::endl;
+    }
+    catch(const std::exception& aError)
+    {
+      std::cout << "Rejected with reason: " << aError.what() << std::endl;
+    }
   }
   //Promise<int> test([](Promise<int>::TResolver aResolve, Promise<int>::TRejecter aReject){sleep(2); aResolve(7);});
   
@@ -46,10 +57,10 @@ int main(int argc, char** argv)
       return 0;
     };
 
-  sleep(1);
   auto a = All(p2).then(firstHandler);
   //std::cout << "more stuff" << std::endl;
   std::cout << "After all..." << std::endl;
+  a.Wait();
 
   /*
   Promise<int> p4(e);
@@ -1,39 +1,170 @@
-#include <future>
+#ifndef PROMISE_H
+#define PROMISE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
 #include <functional>
-#include <string>
+#include <iterator>
+#include <memory>
 #include <mutex>
-#include <condition_variable>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <optional>
 #include <tuple>
+#include <type_traits>
+#include <utility>
 #include <vector>
-#include <iostream>
+#include <chrono>
+
+#include "allocator.h"
+#include "cancellation.h"
+#include "executor.h"
+#include "function.h"
+#include "metrics.h"
+#include "timer.h"
 
 /*
    template class Promise: non-void template return type
 
      Executor: takes (resolve, reject) as parametsr, returns void, must call resolve with result or reject with reason
+     Reason: std::exception_ptr; an exception thrown by an executor or handler rejects with that exception
+     Scheduler: NPromise::Executor the executor is posted to (see executor.h); defaults to GetDefaultExecutor()
+        GetInlineExecutor() runs the executor synchronously in the constructor
+     Promise<T>::Resolved(value), Promise<T>::Rejected(reason): already settled promise, nothing is posted
      .then()
         returns another Promise (possibly with different retutn type; in that case new type must be convertible to return type of original promise)
         takes a handler function to be executed when orignal promise resolves as first parameter, and handler to be executed when orignal promise is rejected as second parameter
            - handler takes const ref to original promise return type as first argument
            - handler either 
                 - returns void and takes two extra parameters (resolve, reject); handler code is executed synchronously when original promise resolves and handler must call either resolve or reject 
+                - returns a value; the returned Promise resolves with it
                 - returns a Promise (possibly with another template parameter type) and takes no extra parameters
+           - handlers can be any callable; the form is picked from the handler signature
+        on an rvalue Promise (std::move(p).then(...), or chained then() calls) the handler gets the result as rvalue instead:
+        moved out when no other handle or then() handler can read it anymore, copied otherwise; a move-only result that
+        is still read elsewhere rejects the promise returned by then() with std::logic_error instead
+     .TakeResult() &&: same for reading the result of the last handle, throws that std::logic_error itself
+     .Catch()
+        takes a handler that gets the reason of a rejection and returns a value to fulfill the returned Promise with, or rethrows
+        takes an optional scheduler as last parameter; by default the new Promise runs on the scheduler of the original promise
+        registers a continuation on the original promise; nothing waits on a thread while it is pending
+        handlers run with no lock held and may read the original promise; every continuation is posted as its own task,
+        so the handlers of many then() on one promise run in parallel on a multi-threaded executor
+        without scheduler, a handler attached to an already settled promise runs right away on the calling thread
+        a rejection without reject handler is passed on to the returned Promise
+
+   Allocation: a Promise is one pointer to an intrusively refcounted state block that holds the state, the result and the
+   continuations, so creating a promise is a single allocation. The result is only constructed on fulfillment: T need not
+   be default constructible, but then GetResult() and TakeResult() throw std::logic_error while the promise is not fulfilled.
+   State blocks and continuations come from per-thread pools (see allocator.h), so creating and settling
+   short-lived promises does not reach malloc once the pools are warm; Promise(std::allocator_arg, allocator, executor)
+   takes another allocator for the state block
+
+   Waiting: Wait(), WaitFor(duration) and WaitUntil(time_point) block the calling thread until the promise settles;
+   GetResult() and GetReason() do not wait. Timeout(duration or deadline) returns a Promise that rejects with TimeoutError
+   if the original is still pending at the deadline, std::move(p).Timeout() moves the result instead of copying it;
+   all deadlines share one timer thread (see timer.h)
+
+   Batches: SettleBatch settles many promises at once (from an event loop, say) and posts the continuations they trigger
+   with one PostBatch() per executor; ResolveBatch(begin, end) does that for a range of (resolver, value) pairs
+
+   Cancellation: the constructor, then() and All() take an optional CancellationToken (see cancellation.h);
+   cancelling it rejects the pending promises with CancelledError and skips executors and handlers that did not start yet
+
+   Coroutines (C++20): include coroutine.h to co_await a Promise and to return Promise<T> from a coroutine
+
+   Tracing: compiled out unless PROMISE_TRACE is defined; then every event is passed as a TraceRecord to the sink set with SetTraceSink()
+
+   Metrics: compiled out unless PROMISE_METRICS is defined; then GetMetrics() returns counts, gauges and latency histograms (see metrics.h)
  */
 
-static std::atomic<int> promiseCount(0);
+namespace NPromise {
+
+  // SETTLING: a resolver or rejecter won the race and is writing iResult or iReason; reads as pending
+  enum class PromiseState { PENDING = 0, SETTLING, FULFILLED, REJECTED };
+
+  enum class TraceEvent { CREATED = 0, SETTLED, CONTINUATION_RAN };
+
+  struct TraceRecord
+  {
+    TraceEvent iEvent;
+    std::uint64_t iPromiseId;
+    PromiseState iState;
+    std::chrono::steady_clock::time_point iTime;
+  };
+
+  // Called on the thread the event happens on; must be thread safe and should not block
+  typedef void (*TTraceSink)(const TraceRecord&);
+
+  namespace NDetail {
+    inline std::atomic<TTraceSink>& TraceSink()
+    {
+      static std::atomic<TTraceSink> sink(nullptr);
+      return sink;
+    }
+
+    inline std::uint64_t NextTraceId()
+    {
+      static std::atomic<std::uint64_t> id(0);
+      return id.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
 
-namespace {
-  void PromiseDebug(std::ostream& aOstream, const std::string& aMessage)
+  // Has no effect unless PROMISE_TRACE is defined
+  inline void SetTraceSink(TTraceSink aSink)
   {
-    #ifdef PROMISE_DEBUG
-    aOstream << aMessage << std::endl;
-    #endif
+    NDetail::TraceSink().store(aSink, std::memory_order_release);
   }
-}
 
-namespace NPromise {
+  namespace NDetail {
+    // Continuations held back by a SettleBatch, grouped per executor so each executor gets one PostBatch()
+    class ContinuationBatch
+    {
+    public:
+      void Add(Executor& aScheduler, Executor::TTask aTask)
+      {
+        for (Group& group : iGroups)
+          if (group.iScheduler == &aScheduler)
+          {
+            group.iTasks.push_back(std::move(aTask));
+            return;
+          }
+        iGroups.push_back(Group{&aScheduler, {}});
+        iGroups.back().iTasks.push_back(std::move(aTask));
+      }
 
-  enum class PromiseState { PENDING = 0, FULFILLED, REJECTED };
+      // Keeps the groups and their capacity for the next batch. Promises that the flushed tasks settle post their own
+      // continuations directly, the batch is not passed on. By index and with the tasks swapped out all the same: an
+      // inline executor runs them right here, and one that captured the SettleBatch being flushed may add to it
+      void Flush()
+      {
+        for (std::size_t i = 0; i < iGroups.size(); ++i)
+        {
+          if (iGroups[i].iTasks.empty())
+            continue;
+          std::vector<Executor::TTask> tasks;
+          tasks.swap(iGroups[i].iTasks);
+          iGroups[i].iScheduler->PostBatch(tasks.data(), tasks.size());
+          if (iGroups[i].iTasks.empty())
+          {
+            tasks.clear();
+            iGroups[i].iTasks.swap(tasks);
+          }
+        }
+      }
+
+    private:
+      struct Group
+      {
+        Executor* iScheduler;
+        std::vector<Executor::TTask> iTasks;
+      };
+
+      std::vector<Group> iGroups;
+    };
+  }
 
   template<typename taResolvedType>
   struct PromiseStateHolder;
@@ -41,32 +172,618 @@ namespace NPromise {
   template<>
   struct PromiseStateHolder<void>
   {
-    PromiseState iState;
-    std::string iReason;
-    std::mutex iMutex;
-    std::condition_variable iConditionVariable;
+    // Task posted to iScheduler once the promise settles (run inline by the settling thread if iScheduler is null);
+    // kept in a lock-free stack until then. The task reaches the promise through a plain pointer, so a pending
+    // promise is not kept alive by its own continuations; iSettled holds the reference once the task is on its way
+    struct Continuation
+    {
+      Continuation* iNext;
+      Executor* iScheduler;
+      Executor::TTask iTask;
+      bool iReader;
+      PromiseStateHolder<void>* iSettled = nullptr;
+
+      ~Continuation()
+      {
+        iTask = nullptr;
+        if (iSettled)
+        {
+          if (iReader)
+            iSettled->ReleaseHandle();
+          else
+            iSettled->Release();
+        }
+      }
+
+      static void* operator new(std::size_t aSize) { return NDetail::BlockPool::Allocate(aSize); }
+      static void operator delete(void* aPointer, std::size_t aSize) noexcept { NDetail::BlockPool::Deallocate(aPointer, aSize); }
+    };
+
+    std::atomic<PromiseState> iState;
+    std::exception_ptr iReason;
+    Executor* iScheduler;
+    std::atomic<Continuation*> iContinuations;
+    // Low half: Promise handles, resolvers, rejecters and continuations referring to this state, see StatePtr.
+    // High half: Promise handles and continuations that may still read the result, which only the last one moves out.
+    // One word, so that copying or dropping a Promise handle is a single atomic operation
+    std::atomic<std::uint64_t> iCounts;
+    static constexpr std::uint64_t REFERENCE = 1;
+    static constexpr std::uint64_t READER = std::uint64_t(1) << 32;
+    // Destroys the complete state and frees it through the allocator it was made with
+    void (*iDestroy)(PromiseStateHolder<void>*);
+#ifdef PROMISE_TRACE
+    std::uint64_t iTraceId;
+#endif
+#ifdef PROMISE_METRICS
+    // Zero unless this promise was picked for timing, see metrics.h
+    std::chrono::steady_clock::time_point iCreatedTime;
+    std::chrono::steady_clock::time_point iSettledTime;
+#endif
+
+    PromiseStateHolder()
+      : iState(PromiseState::PENDING), iScheduler(nullptr), iContinuations(nullptr), iCounts(0), iDestroy(nullptr)
+    {
+#ifdef PROMISE_TRACE
+      iTraceId = NDetail::NextTraceId();
+#endif
+#ifdef PROMISE_METRICS
+      if (NDetail::SampleLatency())
+        iCreatedTime = std::chrono::steady_clock::now();
+#endif
+      Observe(TraceEvent::CREATED);
+    }
+
+    PromiseStateHolder(const PromiseStateHolder&) = delete;
+    PromiseStateHolder& operator=(const PromiseStateHolder&) = delete;
+
+    ~PromiseStateHolder()
+    {
+#ifdef PROMISE_METRICS
+      NDetail::CountMetric(NDetail::MetricsCounter::DESTROYED);
+      if (!IsSettled())
+        NDetail::CountMetric(NDetail::MetricsCounter::DESTROYED_PENDING);
+#endif
+
+      // Never settled: continuations were never run
+      Continuation* c = iContinuations.load(std::memory_order_acquire);
+      while (c && c != Closed())
+      {
+        Continuation* next = c->iNext;
+        delete c;
+        c = next;
+      }
+    }
+
+    PromiseState GetState() const { return iState.load(std::memory_order_acquire); }
+
+    void AddRef() { iCounts.fetch_add(REFERENCE, std::memory_order_relaxed); }
+
+    void Release() { Release(REFERENCE); }
+
+    void AddReader() { iCounts.fetch_add(READER, std::memory_order_relaxed); }
+
+    // Release: a reader that moves the result out afterwards sees every read of the others completed
+    void ReleaseReader() { iCounts.fetch_sub(READER, std::memory_order_release); }
+
+    // Reference and reader at once, for Promise handles
+    void AddHandle() { iCounts.fetch_add(REFERENCE + READER, std::memory_order_relaxed); }
+
+    void ReleaseHandle() { Release(REFERENCE + READER); }
+
+    std::size_t ReferenceCount() const { return std::size_t(iCounts.load(std::memory_order_acquire) % READER); }
+
+    std::size_t ReaderCount() const { return std::size_t(iCounts.load(std::memory_order_acquire) / READER); }
+
+    // Whether a continuation reads the result: no (it only signals), with a reader count of its own, or with the count
+    // of the Promise handle it was made from, which the caller gives up
+    enum class Reader { NONE = 0, ADDED, TAKEN_OVER };
+
+    bool IsSettled() const
+    {
+      PromiseState state = GetState();
+      return state == PromiseState::FULFILLED || state == PromiseState::REJECTED;
+    }
+
+    // Scheduler to pass to AddContinuation(): aScheduler if given; none if this promise already settled, so the
+    // continuation runs right away on the calling thread; iScheduler otherwise
+    Executor* ContinuationScheduler(Executor* aScheduler) const
+    {
+      if (aScheduler)
+        return aScheduler;
+      return IsSettled() ? nullptr : iScheduler;
+    }
+
+    // Passes aEvent to the trace sink and to the metrics; does nothing unless PROMISE_TRACE or PROMISE_METRICS is defined
+    void Observe(TraceEvent aEvent) const
+    {
+#ifdef PROMISE_TRACE
+      TTraceSink sink = NDetail::TraceSink().load(std::memory_order_acquire);
+      if (sink)
+        sink(TraceRecord{aEvent, iTraceId, iState.load(std::memory_order_relaxed), std::chrono::steady_clock::now()});
+#endif
+#ifdef PROMISE_METRICS
+      switch (aEvent)
+      {
+        case TraceEvent::CREATED:
+          NDetail::CountMetric(NDetail::MetricsCounter::CREATED);
+          break;
+        case TraceEvent::SETTLED:
+          NDetail::CountMetric(GetState() == PromiseState::FULFILLED ? NDetail::MetricsCounter::FULFILLED : NDetail::MetricsCounter::REJECTED);
+          if (iSettledTime != std::chrono::steady_clock::time_point())
+            NDetail::RecordSettleLatency(iSettledTime - iCreatedTime);
+          break;
+        case TraceEvent::CONTINUATION_RAN:
+          if (iSettledTime != std::chrono::steady_clock::time_point())
+            NDetail::RecordContinuationDelay(std::chrono::steady_clock::now() - iSettledTime);
+          break;
+      }
+#endif
+      (void)aEvent;
+    }
+
+    // Posts aTask to aScheduler when this promise settles, or right away if it already has.
+    // Without scheduler aTask runs inline on the settling (or calling) thread, so it must be short and must not throw.
+    // aTask must not own a reference to this promise: it can use a plain pointer, the promise lives until aTask ran
+    void AddContinuation(Executor* aScheduler, Executor::TTask aTask, Reader aReader = Reader::ADDED)
+    {
+      if (aReader == Reader::ADDED)
+        AddReader();
+
+      Continuation* head = iContinuations.load(std::memory_order_acquire);
+      if (head == Closed() && !aScheduler)
+      {
+        // The caller holds a reference while aTask runs
+        aTask();
+        if (aReader != Reader::NONE)
+          ReleaseReader();
+        return;
+      }
+
+      Continuation* c = new Continuation{head, aScheduler, std::move(aTask), aReader != Reader::NONE};
+      while (c->iNext != Closed())
+      {
+        if (iContinuations.compare_exchange_weak(c->iNext, c, std::memory_order_release, std::memory_order_acquire))
+          return;
+      }
+      AddRef();
+      c->iSettled = this;
+      Dispatch(c, nullptr);
+    }
+
+    // Blocks until this promise settled, or until *aDeadline if given; true if it settled
+    template<typename taClock, typename taDuration>
+    bool Wait(const std::chrono::time_point<taClock, taDuration>* aDeadline)
+    {
+      if (IsSettled())
+        return true;
+
+      struct Waiter
+      {
+        std::mutex iMutex;
+        std::condition_variable iConditionVariable;
+        bool iDone = false;
+      };
+      // Shared with the continuation, which outlives a wait that timed out
+      std::shared_ptr<Waiter> waiter = std::make_shared<Waiter>();
+      AddContinuation(nullptr, [waiter]()
+      {
+        {
+          std::lock_guard<std::mutex> l(waiter->iMutex);
+          waiter->iDone = true;
+        }
+        waiter->iConditionVariable.notify_all();
+      }, Reader::NONE);
+
+      NDetail::BeforeBlocking();
+      std::unique_lock<std::mutex> l(waiter->iMutex);
+      if (!aDeadline)
+      {
+        waiter->iConditionVariable.wait(l, [&](){ return waiter->iDone; });
+        return true;
+      }
+      return waiter->iConditionVariable.wait_until(l, *aDeadline, [&](){ return waiter->iDone; });
+    }
+
+    // With aBatch, continuations that have a scheduler are added to it instead of being posted
+    void Reject(std::exception_ptr aReason, NDetail::ContinuationBatch* aBatch = nullptr)
+    {
+      if (!BeginSettle())
+        return;
+      iReason = std::move(aReason);
+      EndSettle(PromiseState::REJECTED, aBatch);
+    }
+
+  protected:
+    void Release(std::uint64_t aCounts)
+    {
+      if (iCounts.fetch_sub(aCounts, std::memory_order_acq_rel) % READER == REFERENCE)
+        iDestroy(this);
+    }
+
+    // Marks the continuation stack once it has been taken by EndSettle()
+    static Continuation* Closed() { return reinterpret_cast<Continuation*>(std::uintptr_t(1)); }
+
+    // PENDING -> SETTLING; only the first resolver or rejecter gets to write the outcome
+    bool BeginSettle()
+    {
+      PromiseState expected = PromiseState::PENDING;
+      return iState.compare_exchange_strong(expected, PromiseState::SETTLING, std::memory_order_acquire, std::memory_order_relaxed);
+    }
+
+    // SETTLING -> aState, publishes the outcome and posts the registered continuations in order
+    void EndSettle(PromiseState aState, NDetail::ContinuationBatch* aBatch = nullptr)
+    {
+#ifdef PROMISE_METRICS
+      // Before the store: continuations added from now on read it without synchronizing any further
+      if (iCreatedTime != std::chrono::steady_clock::time_point())
+        iSettledTime = std::chrono::steady_clock::now();
+#endif
+      iState.store(aState, std::memory_order_release);
+      Observe(TraceEvent::SETTLED);
+
+      Continuation* c = iContinuations.exchange(Closed(), std::memory_order_acq_rel);
+      Continuation* ordered = nullptr;
+      std::size_t count = 0;
+      while (c)
+      {
+        Continuation* next = c->iNext;
+        c->iNext = ordered;
+        ordered = c;
+        c = next;
+        ++count;
+      }
+      if (count > 0)
+        iCounts.fetch_add(count * REFERENCE, std::memory_order_relaxed);
+      while (ordered)
+      {
+        Continuation* next = ordered->iNext;
+        ordered->iSettled = this;
+        Dispatch(ordered, aBatch);
+        ordered = next;
+      }
+    }
+
+    // Runs aContinuation right away without scheduler, posts it (or adds it to aBatch) otherwise; deletes it once it ran
+    static void Dispatch(Continuation* aContinuation, NDetail::ContinuationBatch* aBatch)
+    {
+      Executor* scheduler = aContinuation->iScheduler;
+      if (!scheduler)
+      {
+        aContinuation->iTask();
+        delete aContinuation;
+        return;
+      }
+
+      Executor::TTask task([continuation=std::unique_ptr<Continuation>(aContinuation)]() { continuation->iTask(); });
+      if (aBatch)
+        aBatch->Add(*scheduler, std::move(task));
+      else
+        scheduler->Post(std::move(task));
+    }
   };
 
   template<typename taResolvedType>
   struct PromiseStateHolder : public PromiseStateHolder<void>
   {
-    //PromiseState iState;
-    taResolvedType iResult;
-    //std::string iReason;
-    //std::mutex iMutex;
-    //std::condition_variable iConditionVariable;
+    // Constructed by Resolve(): only alive once FULFILLED, so taResolvedType need not be default constructible
+    union
+    {
+      taResolvedType iResult;
+    };
+
+    PromiseStateHolder() {}
+
+    ~PromiseStateHolder()
+    {
+      if (iState.load(std::memory_order_relaxed) == PromiseState::FULFILLED)
+        iResult.~taResolvedType();
+    }
+
+    // Copies or moves aResult into iResult; rejects with the exception if that throws. See Reject() for aBatch
+    template<typename taValue>
+    void Resolve(taValue&& aResult, NDetail::ContinuationBatch* aBatch = nullptr)
+    {
+      if (!BeginSettle())
+        return;
+      try
+      {
+        new (&iResult) taResolvedType(std::forward<taValue>(aResult));
+      }
+      catch(...)
+      {
+        iReason = std::current_exception();
+        EndSettle(PromiseState::REJECTED, aBatch);
+        return;
+      }
+      EndSettle(PromiseState::FULFILLED, aBatch);
+    }
   };
 
+  // Intrusive reference to a PromiseStateHolder: one pointer, one atomic count in the state itself
   template<typename taResolvedType>
-  class PromiseBase
+  class StatePtr
   {
+  public:
+    StatePtr() noexcept
+      : iState(nullptr)
+    {
+    }
+
+    StatePtr(std::nullptr_t) noexcept
+      : iState(nullptr)
+    {
+    }
+
+    explicit StatePtr(PromiseStateHolder<taResolvedType>* aState) noexcept
+      : iState(aState)
+    {
+      if (iState)
+        iState->AddRef();
+    }
 
+    // Takes over a reference the caller counted already
+    struct AdoptTag {};
+
+    StatePtr(PromiseStateHolder<taResolvedType>* aState, AdoptTag) noexcept
+      : iState(aState)
+    {
+    }
+
+    StatePtr(const StatePtr& aOther) noexcept
+      : StatePtr(aOther.iState)
+    {
+    }
+
+    StatePtr(StatePtr&& aOther) noexcept
+      : iState(aOther.iState)
+    {
+      aOther.iState = nullptr;
+    }
+
+    // From the state of a typed promise to its PromiseStateHolder<void> base
+    template<typename taOtherResolvedType,
+             typename = std::enable_if_t<std::is_convertible<PromiseStateHolder<taOtherResolvedType>*, PromiseStateHolder<taResolvedType>*>::value>>
+    StatePtr(const StatePtr<taOtherResolvedType>& aOther) noexcept
+      : StatePtr(aOther.iState)
+    {
+    }
+
+    template<typename taOtherResolvedType,
+             typename = std::enable_if_t<std::is_convertible<PromiseStateHolder<taOtherResolvedType>*, PromiseStateHolder<taResolvedType>*>::value>>
+    StatePtr(StatePtr<taOtherResolvedType>&& aOther) noexcept
+      : iState(aOther.iState)
+    {
+      aOther.iState = nullptr;
+    }
+
+    ~StatePtr()
+    {
+      if (iState)
+        iState->Release();
+    }
+
+    StatePtr& operator=(StatePtr aOther) noexcept
+    {
+      std::swap(iState, aOther.iState);
+      return *this;
+    }
+
+    PromiseStateHolder<taResolvedType>* operator->() const { return iState; }
+    PromiseStateHolder<taResolvedType>& operator*() const { return *iState; }
+
+    explicit operator bool() const { return iState != nullptr; }
+    bool operator==(std::nullptr_t) const { return iState == nullptr; }
+    bool operator!=(std::nullptr_t) const { return iState != nullptr; }
+
+    std::size_t UseCount() const { return iState ? iState->ReferenceCount() : 0; }
+
+    // Gives up the reference without releasing it
+    PromiseStateHolder<taResolvedType>* Detach() noexcept
+    {
+      PromiseStateHolder<taResolvedType>* state = iState;
+      iState = nullptr;
+      return state;
+    }
+
+  private:
+    template<typename taOtherResolvedType> friend class StatePtr;
+
+    PromiseStateHolder<taResolvedType>* iState;
   };
 
-  
+  namespace NDetail {
+    // State block allocated through taAllocator, which it keeps to free itself
+    template<typename taResolvedType, typename taAllocator>
+    struct AllocatedState : public PromiseStateHolder<taResolvedType>
+    {
+      typedef typename std::allocator_traits<taAllocator>::template rebind_alloc<AllocatedState> TAllocator;
+
+      explicit AllocatedState(const TAllocator& aAllocator)
+        : iAllocator(aAllocator)
+      {
+        this->iDestroy = &Destroy;
+      }
+
+      static void Destroy(PromiseStateHolder<void>* aState)
+      {
+        AllocatedState* state = static_cast<AllocatedState*>(aState);
+        TAllocator allocator(std::move(state->iAllocator));
+        std::allocator_traits<TAllocator>::destroy(allocator, state);
+        std::allocator_traits<TAllocator>::deallocate(allocator, state, 1);
+      }
+
+      TAllocator iAllocator;
+    };
+
+    template<typename taResolvedType, typename taAllocator>
+    StatePtr<taResolvedType> MakeState(const taAllocator& aAllocator)
+    {
+      typedef AllocatedState<taResolvedType, taAllocator> TState;
+      typename TState::TAllocator allocator(aAllocator);
+      TState* state = std::allocator_traits<typename TState::TAllocator>::allocate(allocator, 1);
+      try
+      {
+        std::allocator_traits<typename TState::TAllocator>::construct(allocator, state, allocator);
+      }
+      catch(...)
+      {
+        std::allocator_traits<typename TState::TAllocator>::deallocate(allocator, state, 1);
+        throw;
+      }
+      return StatePtr<taResolvedType>(state);
+    }
+  }
 
   template<typename taResolvedType> class Promise;
 
+  namespace NDetail {
+    struct PromiseAccess;
+
+    template<typename taType>
+    struct PromiseTraits
+    {
+      static constexpr bool IsPromise = false;
+    };
+
+    template<typename taResolvedType>
+    struct PromiseTraits<Promise<taResolvedType>>
+    {
+      static constexpr bool IsPromise = true;
+      typedef taResolvedType TResolvedType;
+    };
+
+    // Promise executor or then() handler that is skipped, rejecting with CancelledError, once iToken is cancelled;
+    // keeps the signature of taHandler, so then() picks the same form as for the plain handler
+    template<typename taHandler>
+    struct CancellableHandler
+    {
+      taHandler iHandler;
+      CancellationToken iToken;
+
+      template<typename... taArgs>
+      auto operator()(taArgs&&... aArgs) -> decltype(std::invoke(iHandler, std::forward<taArgs>(aArgs)...))
+      {
+        if (iToken.IsCancelled())
+          throw CancelledError();
+        return std::invoke(iHandler, std::forward<taArgs>(aArgs)...);
+      }
+    };
+
+    // Rejects the promise with CancelledError when aToken is cancelled while it is pending.
+    // The callback keeps the state alive until the promise settles, the token is cancelled or its last source is gone
+    inline void RejectOnCancel(const StatePtr<void>& aStatePtr, const CancellationToken& aToken)
+    {
+      if (!aToken.CanBeCancelled() || aStatePtr->IsSettled())
+        return;
+
+      CancellationRegistration registration = aToken.OnCancel([statePtr=aStatePtr]()
+      {
+        statePtr->Reject(std::make_exception_ptr(CancelledError()));
+      });
+      // Unregisters once the promise settles, so a long-lived token does not collect callbacks of settled promises
+      aStatePtr->AddContinuation(nullptr, [registration=std::move(registration)]() {}, PromiseStateHolder<void>::Reader::NONE);
+    }
+  }
+
+  // Passed to executors and resolve handlers; an rvalue result is moved into the promise instead of copied
+  template<typename taResolvedType>
+  class Resolver
+  {
+  public:
+    Resolver() {}
+
+    void operator()(const taResolvedType& aResult) const { iStatePtr->Resolve(aResult); }
+    void operator()(taResolvedType&& aResult) const { iStatePtr->Resolve(std::move(aResult)); }
+
+    explicit operator bool() const { return iStatePtr != nullptr; }
+
+  private:
+    template<typename taOtherResolvedType> friend class Promise;
+    friend class SettleBatch;
+
+    explicit Resolver(StatePtr<taResolvedType> aStatePtr)
+      : iStatePtr(std::move(aStatePtr))
+    {
+    }
+
+    StatePtr<taResolvedType> iStatePtr;
+  };
+
+  // Passed to executors and handlers of every Promise type to reject it
+  class Rejecter
+  {
+  public:
+    Rejecter() {}
+
+    void operator()(std::exception_ptr aReason) const { iStatePtr->Reject(std::move(aReason)); }
+
+    // Convenience for plain text reasons: rejects with a std::runtime_error
+    void operator()(const std::string& aReason) const { iStatePtr->Reject(std::make_exception_ptr(std::runtime_error(aReason))); }
+
+    explicit operator bool() const { return iStatePtr != nullptr; }
+
+  private:
+    template<typename taOtherResolvedType> friend class Promise;
+    friend class SettleBatch;
+
+    explicit Rejecter(StatePtr<void> aStatePtr)
+      : iStatePtr(std::move(aStatePtr))
+    {
+    }
+
+    StatePtr<void> iStatePtr;
+  };
+
+  // Settles many promises in one pass: every promise settles right away, but the continuations that have an executor
+  // are held back until Flush() (or the destructor) and then posted with one PostBatch() per executor
+  class SettleBatch
+  {
+  public:
+    SettleBatch() {}
+
+    SettleBatch(const SettleBatch&) = delete;
+    SettleBatch& operator=(const SettleBatch&) = delete;
+
+    ~SettleBatch()
+    {
+      Flush();
+    }
+
+    template<typename taResolvedType, typename taValue>
+    void Resolve(const Resolver<taResolvedType>& aResolver, taValue&& aResult)
+    {
+      aResolver.iStatePtr->Resolve(std::forward<taValue>(aResult), &iContinuations);
+    }
+
+    void Reject(const Rejecter& aRejecter, std::exception_ptr aReason)
+    {
+      aRejecter.iStatePtr->Reject(std::move(aReason), &iContinuations);
+    }
+
+    void Reject(const Rejecter& aRejecter, const std::string& aReason)
+    {
+      Reject(aRejecter, std::make_exception_ptr(std::runtime_error(aReason)));
+    }
+
+    // Can be called repeatedly: a batch object kept by an event loop reuses its buffers
+    void Flush()
+    {
+      iContinuations.Flush();
+    }
+
+  private:
+    NDetail::ContinuationBatch iContinuations;
+  };
+
+  // Resolves every (resolver, value) pair of the range with one SettleBatch; the values are moved from
+  template<typename taIterator>
+  void ResolveBatch(taIterator aBegin, taIterator aEnd)
+  {
+    SettleBatch batch;
+    for (; aBegin != aEnd; ++aBegin)
+      batch.Resolve(aBegin->first, std::move(aBegin->second));
+  }
+
   template<>
     class Promise<void> 
   {
@@ -78,246 +795,555 @@ namespace NPromise {
   class Promise : public Promise<void>
   {
   public:
-    typedef std::function<void(const taResolvedType&)> TResolver;
-    typedef std::function<void(const std::string&)> TRejecter;
-    typedef std::function<void(const TResolver&, const TRejecter&)> TExecutor;
+    typedef taResolvedType TResolvedType;
+    typedef Resolver<taResolvedType> TResolver;
+    typedef Rejecter TRejecter;
+    typedef Function<void(const TResolver&, const TRejecter&)> TExecutor;
   
-    explicit Promise(const TExecutor& aExecutor)
-    {
-      iStatePtr = std::make_shared<PromiseStateHolder<taResolvedType>>();
-      iCount = promiseCount++;
-      std::cout << "Promise " << iCount << " owns " << &(iStatePtr->iMutex) << std::endl;
-      // Write state into state ptr
-      TResolver r = [ptr=this->iStatePtr](const taResolvedType& aResult)
-      { 
-	std::unique_lock<std::mutex> l(ptr->iMutex);
-        if (ptr->iState != PromiseState::PENDING)
-          return;
-        ptr->iResult = aResult; 
-        ptr->iState = PromiseState::FULFILLED;
-        l.unlock();
-        ptr->iConditionVariable.notify_all();
-      };
-      TRejecter e = [ptr=this->iStatePtr](const std::string& aReason)
-      {
-        std::unique_lock<std::mutex> l(ptr->iMutex);
-        if (ptr->iState != PromiseState::PENDING)
-          return;
-        ptr->iReason = aReason; 
-        ptr->iState = PromiseState::REJECTED;
-        l.unlock();
-        ptr->iConditionVariable.notify_all();
-      }; 
+    // aExecutor: TExecutor or any other callable taking (resolve, reject)
+    template<typename taExecutor,
+             typename = std::enable_if_t<std::is_invocable<std::decay_t<taExecutor>&, const TResolver&, const TRejecter&>::value>>
+    explicit Promise(taExecutor&& aExecutor, Executor* aScheduler = nullptr)
+      : Promise(std::allocator_arg, PoolAllocator<char>(), std::forward<taExecutor>(aExecutor), aScheduler)
+    {
+    }
+
+    // Same; the executor is skipped if aToken is cancelled before it starts, and the promise is rejected with
+    // CancelledError as soon as aToken is cancelled. A running executor can poll aToken itself
+    template<typename taExecutor,
+             typename = std::enable_if_t<std::is_invocable<std::decay_t<taExecutor>&, const TResolver&, const TRejecter&>::value>>
+    Promise(taExecutor&& aExecutor, const CancellationToken& aToken, Executor* aScheduler = nullptr)
+      : Promise(NDetail::CancellableHandler<std::decay_t<taExecutor>>{std::forward<taExecutor>(aExecutor), aToken}, aScheduler)
+    {
+      NDetail::RejectOnCancel(iStatePtr, aToken);
+    }
 
-      // Pass functions by value
-      TExecutor wrappedExecutor = [aExecutor](TResolver aResolver, TRejecter aRejecter)
+    // Same, with the state block allocated through aAllocator; promises returned by then() use the default pool
+    template<typename taAllocator, typename taExecutor,
+             typename = std::enable_if_t<std::is_invocable<std::decay_t<taExecutor>&, const TResolver&, const TRejecter&>::value>>
+    Promise(std::allocator_arg_t, const taAllocator& aAllocator, taExecutor&& aExecutor, Executor* aScheduler = nullptr)
+      : Promise(aScheduler ? *aScheduler : GetDefaultExecutor(), aAllocator)
+    {
+      // Resolve and reject functions are made on the executor thread, the task only carries the executor and the state
+      iStatePtr->iScheduler->Post([executor=std::forward<taExecutor>(aExecutor), ptr=iStatePtr]() mutable
       {
+        TResolver r = MakeResolver(ptr);
+        TRejecter e = MakeRejecter(ptr);
 	try 
         {
-	  aExecutor(aResolver, aRejecter);
+	  executor(r, e);
 	}
         catch(...)
         {
-	  aRejecter("Unexpected exception thrown!");
+	  e(std::current_exception());
 	}
-      };
+      });
+    }
+
+    // Already fulfilled promise: no task is posted, and then() handlers without scheduler run right away
+    template<typename taValue = taResolvedType>
+    static Promise<taResolvedType> Resolved(taValue&& aResult, Executor* aScheduler = nullptr)
+    {
+      Promise<taResolvedType> promise(aScheduler ? *aScheduler : GetDefaultExecutor());
+      promise.iStatePtr->Resolve(std::forward<taValue>(aResult));
+      return promise;
+    }
+
+    static Promise<taResolvedType> Rejected(std::exception_ptr aReason, Executor* aScheduler = nullptr)
+    {
+      Promise<taResolvedType> promise(aScheduler ? *aScheduler : GetDefaultExecutor());
+      promise.iStatePtr->Reject(std::move(aReason));
+      return promise;
+    }
+
+    // Convenience for plain text reasons: rejects with a std::runtime_error
+    static Promise<taResolvedType> Rejected(const std::string& aReason, Executor* aScheduler = nullptr)
+    {
+      return Rejected(std::make_exception_ptr(std::runtime_error(aReason)), aScheduler);
+    }
+
+    // A Promise is one StatePtr wide: copies share the state and count as one more reader of the result (see
+    // TakeResult()), with one atomic operation for the reference and the reader; a moved-from Promise is empty
+    Promise(Promise<taResolvedType>&& aOther) = default;
+
+    Promise(const Promise<taResolvedType>& aOther)
+    {
+      if (aOther.iStatePtr)
+      {
+        aOther.iStatePtr->AddHandle();
+        iStatePtr = StatePtr<taResolvedType>(&*aOther.iStatePtr, typename StatePtr<taResolvedType>::AdoptTag());
+      }
+    }
+
+    ~Promise()
+    {
+      if (iStatePtr)
+        iStatePtr.Detach()->ReleaseHandle();
+    }
+
+    Promise<taResolvedType>& operator=(Promise<taResolvedType> aOther) noexcept
+    {
+      std::swap(iStatePtr, aOther.iStatePtr);
+      return *this;
+    }
+ 
+    template<typename taNewResolvedType = void, typename taHandler>
+    auto then(taHandler&& aHandler, Executor* aScheduler = nullptr) const&
+    {
+      return Then<taNewResolvedType, false>(iStatePtr, std::forward<taHandler>(aHandler), nullptr, aScheduler);
+    }
+
+    template<typename taNewResolvedType = void, typename taResolveHandler, typename taRejectHandler,
+             typename = std::enable_if_t<!std::is_convertible<taRejectHandler, Executor*>::value &&
+                                         !std::is_same<std::decay_t<taRejectHandler>, CancellationToken>::value>>
+    auto then(taResolveHandler&& aResolveHandler, taRejectHandler&& aRejectHandler, Executor* aScheduler = nullptr) const&
+    {
+      return Then<taNewResolvedType, false>(iStatePtr, std::forward<taResolveHandler>(aResolveHandler),
+                                            std::forward<taRejectHandler>(aRejectHandler), aScheduler);
+    }
+
+    // Consuming then(): this handle gives up its reference and the handler gets the result as rvalue
+    template<typename taNewResolvedType = void, typename taHandler>
+    auto then(taHandler&& aHandler, Executor* aScheduler = nullptr) &&
+    {
+      return Then<taNewResolvedType, true>(std::move(iStatePtr), std::forward<taHandler>(aHandler), nullptr, aScheduler);
+    }
+
+    template<typename taNewResolvedType = void, typename taResolveHandler, typename taRejectHandler,
+             typename = std::enable_if_t<!std::is_convertible<taRejectHandler, Executor*>::value &&
+                                         !std::is_same<std::decay_t<taRejectHandler>, CancellationToken>::value>>
+    auto then(taResolveHandler&& aResolveHandler, taRejectHandler&& aRejectHandler, Executor* aScheduler = nullptr) &&
+    {
+      return Then<taNewResolvedType, true>(std::move(iStatePtr), std::forward<taResolveHandler>(aResolveHandler),
+                                           std::forward<taRejectHandler>(aRejectHandler), aScheduler);
+    }
+
+    // Cancellable then(): once aToken is cancelled the handler is skipped and the returned Promise rejects with
+    // CancelledError, right away if it is still pending; descendants get that rejection passed on
+    template<typename taNewResolvedType = void, typename taHandler>
+    auto then(taHandler&& aHandler, const CancellationToken& aToken, Executor* aScheduler = nullptr) const&
+    {
+      auto next = Then<taNewResolvedType, false>(iStatePtr, NDetail::CancellableHandler<std::decay_t<taHandler>>{std::forward<taHandler>(aHandler), aToken},
+                                                 nullptr, aScheduler);
+      NDetail::RejectOnCancel(next.iStatePtr, aToken);
+      return next;
+    }
+
+    template<typename taNewResolvedType = void, typename taHandler>
+    auto then(taHandler&& aHandler, const CancellationToken& aToken, Executor* aScheduler = nullptr) &&
+    {
+      auto next = Then<taNewResolvedType, true>(std::move(iStatePtr), NDetail::CancellableHandler<std::decay_t<taHandler>>{std::forward<taHandler>(aHandler), aToken},
+                                                nullptr, aScheduler);
+      NDetail::RejectOnCancel(next.iStatePtr, aToken);
+      return next;
+    }
+
+    // Handler takes the reason of a rejection and returns a value to fulfill the returned Promise with; it can rethrow
+    // the reason (std::rethrow_exception) to keep it rejected. A fulfilled result is passed on unchanged
+    template<typename taHandler>
+    Promise<taResolvedType> Catch(taHandler&& aHandler, Executor* aScheduler = nullptr) const&
+    {
+      return ThenCatch<false>(iStatePtr, std::forward<taHandler>(aHandler), aScheduler);
+    }
+
+    template<typename taHandler>
+    Promise<taResolvedType> Catch(taHandler&& aHandler, Executor* aScheduler = nullptr) &&
+    {
+      return ThenCatch<true>(std::move(iStatePtr), std::forward<taHandler>(aHandler), aScheduler);
+    }
+
+    bool isPending() const 
+    { 
+      PromiseState state = iStatePtr->GetState();
+      return state == PromiseState::PENDING || state == PromiseState::SETTLING;
+    }
+ 
+    bool isFulfilled() const 
+    {
+      return iStatePtr->GetState() == PromiseState::FULFILLED;
+    }
+  
+    bool isRejected() const 
+    {
+      return iStatePtr->GetState() == PromiseState::REJECTED;
+    }
+
+    // Block the calling thread until this promise settles; a task of the executor that has to settle it should not
+    // wait on it, or that executor may run out of threads. Nothing to wait for once the promise settled
+    void Wait() const
+    {
+      iStatePtr->Wait(static_cast<const std::chrono::steady_clock::time_point*>(nullptr));
+    }
+
+    // True if the promise settled within aTimeout
+    template<typename taRep, typename taPeriod>
+    bool WaitFor(const std::chrono::duration<taRep, taPeriod>& aTimeout) const
+    {
+      std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + aTimeout;
+      return iStatePtr->Wait(&deadline);
+    }
+
+    // True if the promise settled by aDeadline
+    template<typename taClock, typename taDuration>
+    bool WaitUntil(const std::chrono::time_point<taClock, taDuration>& aDeadline) const
+    {
+      return iStatePtr->Wait(&aDeadline);
+    }
+
+    // Settles like this promise, or rejects with TimeoutError if this promise is still pending at aDeadline.
+    // The deadline is kept by the shared TimerQueue, no thread waits for it.
+    // Copies the result; std::move(promise).Timeout() moves it (see TakeResult()), for results that cannot be copied
+    Promise<taResolvedType> Timeout(std::chrono::steady_clock::time_point aDeadline, Executor* aScheduler = nullptr) const&
+    {
+      static_assert(std::is_copy_constructible<taResolvedType>::value,
+                    "the result cannot be copied out of a promise that stays readable: std::move(promise).Timeout()");
+      return ThenTimeout<false>(iStatePtr, aDeadline, aScheduler);
+    }
+
+    Promise<taResolvedType> Timeout(std::chrono::steady_clock::time_point aDeadline, Executor* aScheduler = nullptr) &&
+    {
+      return ThenTimeout<true>(std::move(iStatePtr), aDeadline, aScheduler);
+    }
+
+    template<typename taRep, typename taPeriod>
+    Promise<taResolvedType> Timeout(const std::chrono::duration<taRep, taPeriod>& aTimeout, Executor* aScheduler = nullptr) const&
+    {
+      return Timeout(Deadline(aTimeout), aScheduler);
+    }
+
+    template<typename taRep, typename taPeriod>
+    Promise<taResolvedType> Timeout(const std::chrono::duration<taRep, taPeriod>& aTimeout, Executor* aScheduler = nullptr) &&
+    {
+      return std::move(*this).Timeout(Deadline(aTimeout), aScheduler);
+    }
+
+    // Default constructed value while not fulfilled (std::logic_error if taResolvedType is not default constructible);
+    // the reference stays valid as long as a handle to this promise exists
+    const taResolvedType& GetResult() const
+    { 
+      if (iStatePtr->GetState() != PromiseState::FULFILLED)
+        return NotFulfilled<const taResolvedType&>();
+      return iStatePtr->iResult; 
+    }
+
+    // Consumes this handle: the result is moved out when no other handle or continuation can still read it, copied
+    // otherwise; std::logic_error if it cannot be copied
+    taResolvedType TakeResult() &&
+    {
+      Promise<taResolvedType> self(std::move(*this));
+      if (self.iStatePtr->GetState() != PromiseState::FULFILLED)
+        return NotFulfilled<taResolvedType>();
+      return TakeFrom(*self.iStatePtr);
+    }
+ 
+    // Null while not rejected; std::rethrow_exception() it to inspect the error
+    std::exception_ptr GetReason() const 
+    { 
+      if (iStatePtr->GetState() != PromiseState::REJECTED)
+        return nullptr;
+      return iStatePtr->iReason; 
+    }
+
+  private:
+    template<typename taOtherResolvedType> friend class Promise;
+    friend struct NDetail::PromiseAccess;
+
+    // Pending promise without executor, settled through its state by a continuation
+    template<typename taAllocator = PoolAllocator<char>>
+    explicit Promise(Executor& aScheduler, const taAllocator& aAllocator = taAllocator())
+      : iStatePtr(NDetail::MakeState<taResolvedType>(aAllocator))
+    {
+      iStatePtr->iScheduler = &aScheduler;
+      iStatePtr->AddReader();
+    }
+
+    // Result of GetResult() and TakeResult() while not fulfilled
+    template<typename taReturn>
+    static taReturn NotFulfilled()
+    {
+      if constexpr (!std::is_default_constructible<taResolvedType>::value)
+        throw std::logic_error("Promise is not fulfilled");
+      else if constexpr (std::is_reference<taReturn>::value)
+      {
+        static const taResolvedType empty{};
+        return empty;
+      }
+      else
+        return taResolvedType();
+    }
+
+    static TResolver MakeResolver(const StatePtr<taResolvedType>& aStatePtr)
+    {
+      return TResolver(aStatePtr);
+    }
+
+    static TRejecter MakeRejecter(const StatePtr<taResolvedType>& aStatePtr)
+    {
+      return TRejecter(aStatePtr);
+    }
 
-      iExecutorFuture = std::async(std::launch::async, wrappedExecutor, r, e);  
+    // Moves the result out if the caller is the only reader left, copies it otherwise: a handle or continuation that
+    // still reads it never sees a moved-from value. A result that cannot be copied throws std::logic_error instead
+    static taResolvedType TakeFrom(PromiseStateHolder<taResolvedType>& aState)
+    {
+      if (aState.ReaderCount() <= 1)
+        return std::move(aState.iResult);
+      if constexpr (std::is_copy_constructible<taResolvedType>::value)
+        return aState.iResult;
+      else
+        throw std::logic_error("Promise result is still read elsewhere and cannot be copied");
     }
 
-    Promise(Promise<taResolvedType>&& aOther)
+    // Result as passed to a handler: const ref, or an rvalue for a consuming then()
+    template<bool taConsume>
+    static decltype(auto) HandlerArgument(PromiseStateHolder<taResolvedType>& aState)
     {
-      iCount = promiseCount++;
-      std::lock_guard<std::mutex> l(aOther.iStatePtr->iMutex);
-      iExecutorFuture = std::move(aOther.iExecutorFuture);
-      iStatePtr = std::move(aOther.iStatePtr);
-      std::cout << "in move constructor" << std::endl;
+      if constexpr (taConsume)
+        return TakeFrom(aState);
+      else
+        return static_cast<const taResolvedType&>(aState.iResult);
     }
 
-    Promise(const Promise<taResolvedType>& aOther)
+    // A consuming then() moves the state out of its handle: the continuation takes over the reader count of that handle
+    template<bool taConsume>
+    static constexpr PromiseStateHolder<void>::Reader ContinuationReader()
     {
-      iCount = promiseCount++;
-      std::lock_guard<std::mutex> l(aOther.iStatePtr->iMutex);
-      std::cout << "in copy constructor" << std::endl;
-      iStatePtr = aOther.iStatePtr;
-      iExecutorFuture = aOther.iExecutorFuture;
+      return taConsume ? PromiseStateHolder<void>::Reader::TAKEN_OVER : PromiseStateHolder<void>::Reader::ADDED;
     }
 
-    Promise<taResolvedType>& operator=(const Promise<taResolvedType>& aOther)
+    // False for empty std::function objects and null function pointers
+    template<typename taHandler>
+    static bool IsSet(const taHandler& aHandler)
     {
-      if (this == &aOther)
-        return *this;
-    
-      iCount = promiseCount++;
-      std::lock_guard<std::mutex> l(aOther.iStatePtr->iMutex);
-      iStatePtr = aOther.iStatePtr;
-      iExecutorFuture = aOther.iExecutorFuture;
-      std::cout << "in copy assignment operator" << std::endl;
-      return *this;
+      if constexpr (std::is_constructible<bool, const taHandler&>::value)
+        return static_cast<bool>(aHandler);
+      else
+        return true;
     }
 
-    Promise<taResolvedType>& operator=(Promise<taResolvedType>&& aOther)
+    // Picks the then() form from the handler signature, see the comment at the top of this file
+    template<typename taNewResolvedType, bool taConsume, typename taHandler, typename taRejectHandler>
+    static auto Then(StatePtr<taResolvedType> aStatePtr, taHandler&& aHandler, taRejectHandler&& aRejectHandler, Executor* aScheduler)
     {
-      if (this == &aOther)
-        return *this;
-    
-      iCount = promiseCount++;
-      std::lock_guard<std::mutex> l(aOther.iStatePtr->iMutex);
-      iStatePtr = std::move(aOther.iStatePtr);
-      iExecutorFuture = std::move(aOther.iExecutorFuture);
-      std::cout << "in move assignment operator" << std::endl;
-      return *this;
+      typedef std::conditional_t<taConsume, taResolvedType&&, const taResolvedType&> TArgument;
+      typedef std::conditional_t<std::is_void<taNewResolvedType>::value, taResolvedType, taNewResolvedType> TResolverType;
+
+      if constexpr (std::is_invocable<std::decay_t<taHandler>&, TArgument, const typename Promise<TResolverType>::TResolver&,
+                                      const typename Promise<TResolverType>::TRejecter&>::value)
+      {
+        return ThenResolve<TResolverType, taConsume>(std::move(aStatePtr), std::forward<taHandler>(aHandler),
+                                                     std::forward<taRejectHandler>(aRejectHandler), aScheduler);
+      }
+      else
+      {
+        static_assert(std::is_null_pointer<std::decay_t<taRejectHandler>>::value,
+                      "a reject handler requires a resolve handler taking (result, resolve, reject)");
+        typedef std::invoke_result_t<std::decay_t<taHandler>&, TArgument> THandlerResult;
+        if constexpr (NDetail::PromiseTraits<THandlerResult>::IsPromise)
+        {
+          return ThenPromise<typename NDetail::PromiseTraits<THandlerResult>::TResolvedType, taConsume>(std::move(aStatePtr), std::forward<taHandler>(aHandler), aScheduler);
+        }
+        else
+        {
+          typedef std::conditional_t<std::is_void<taNewResolvedType>::value, THandlerResult, taNewResolvedType> TNewResolvedType;
+          return ThenValue<TNewResolvedType, taConsume>(std::move(aStatePtr), std::forward<taHandler>(aHandler), aScheduler);
+        }
+      }
     }
- 
-    template<typename taNewResolvedType = taResolvedType>
-    Promise<taNewResolvedType> then(const std::function<void(const taResolvedType&, const typename Promise<taNewResolvedType>::TResolver&, 
-                                                             const typename Promise<taNewResolvedType>::TRejecter&)>& aResolveHandler,
-                                    const std::function<void(const std::string&, const typename Promise<taNewResolvedType>::TResolver&,
-                                                             const typename Promise<taNewResolvedType>::TRejecter&)>& aRejectHandler = nullptr) const
-    {
-      // New executor: wait for this promise to resolve, then execute resolve or reject handler
-      typename Promise<taNewResolvedType>::TExecutor e = 
-        [ptr=this->iStatePtr, aResolveHandler, aRejectHandler, count=this->iCount](typename Promise<taNewResolvedType>::TResolver aResolver, typename Promise<taNewResolvedType>::TRejecter aRejecter)
+
+    template<typename taNewResolvedType, bool taConsume, typename taResolveHandler, typename taRejectHandler>
+    static Promise<taNewResolvedType> ThenResolve(StatePtr<taResolvedType> aStatePtr, taResolveHandler&& aResolveHandler,
+                                                  taRejectHandler&& aRejectHandler, Executor* aScheduler)
+    {
+      Promise<taNewResolvedType> next(aScheduler ? *aScheduler : *aStatePtr->iScheduler);
+      PromiseStateHolder<taResolvedType>& state = *aStatePtr;
+
+      // Continuation: runs once this promise settled, executes resolve or reject handler
+      state.AddContinuation(state.ContinuationScheduler(aScheduler),
+        [ptr=&state, nextPtr=next.iStatePtr, resolveHandler=std::forward<taResolveHandler>(aResolveHandler),
+         rejectHandler=std::forward<taRejectHandler>(aRejectHandler)]() mutable
         { 
-          std::cout << "Then executor " << count << ": waiting to lock " << &(ptr->iMutex) << std::endl;
-	  std::unique_lock<std::mutex> l(ptr->iMutex);
-          ptr->iConditionVariable.wait(l, [ptr](){return ptr->iState != PromiseState::PENDING;});
-          std::cout << "Then executor " << count << ": locked " << &(ptr->iMutex) << std::endl;
-          if (ptr->iState == PromiseState::FULFILLED)
+          ptr->Observe(TraceEvent::CONTINUATION_RAN);
+          typename Promise<taNewResolvedType>::TResolver resolver = Promise<taNewResolvedType>::MakeResolver(nextPtr);
+          typename Promise<taNewResolvedType>::TRejecter rejecter = Promise<taNewResolvedType>::MakeRejecter(nextPtr);
+          if (ptr->GetState() == PromiseState::FULFILLED)
 	  {
             try 
 	    {
-              aResolveHandler(ptr->iResult, aResolver, aRejecter);
+              resolveHandler(HandlerArgument<taConsume>(*ptr), resolver, rejecter);
             }
             catch(...)
 	    {
-	      aRejecter("Unexpected exception thrown by aResolveHandler!");
+	      rejecter(std::current_exception());
 	    }
+            return;
 	  }
-          else if(aRejectHandler)
-	  {
-	    // Original promise rejected
-            try 
-	    {
-              aRejectHandler(ptr->iReason, aResolver, aRejecter);
+
+          if constexpr (!std::is_null_pointer<std::decay_t<taRejectHandler>>::value)
+          {
+            if (IsSet(rejectHandler))
+            {
+	      // Original promise rejected
+              try 
+	      {
+                rejectHandler(ptr->iReason, resolver, rejecter);
+              }
+              catch(...)
+	      {
+	        rejecter(std::current_exception());
+	      }
+              return;
             }
-            catch(...)
-	    {
-	      aRejecter("Unexpected exception thrown by aRejectHandler!");
-	    }
-	  }
-          l.unlock();
-          std::cout << "Then executor: unlocked " << &(ptr->iMutex) << std::endl;
-        };
+          }
+
+          // No reject handler: pass the rejection on
+          rejecter(ptr->iReason);
+        }, ContinuationReader<taConsume>());
    
-      return Promise<taNewResolvedType>(e);
+      return next;
     }
 
-    template<typename taNewResolvedType>
-    Promise<taNewResolvedType> then(const std::function<taNewResolvedType(const taResolvedType&)>& aHandler) const
+    template<typename taNewResolvedType, bool taConsume, typename taHandler>
+    static Promise<taNewResolvedType> ThenValue(StatePtr<taResolvedType> aStatePtr, taHandler&& aHandler, Executor* aScheduler)
     {
-      // New executor: wait for this promise to resolve, then execute handler
-      typename Promise<taNewResolvedType>::TExecutor e = 
-        [ptr=this->iStatePtr, aHandler, count=this->iCount](const typename Promise<taNewResolvedType>::TResolver& aResolver,
-							    const typename Promise<taNewResolvedType>::TRejecter& aRejecter)
+      Promise<taNewResolvedType> next(aScheduler ? *aScheduler : *aStatePtr->iScheduler);
+      PromiseStateHolder<taResolvedType>& state = *aStatePtr;
+
+      // Continuation: runs once this promise settled, executes handler or passes the rejection on
+      state.AddContinuation(state.ContinuationScheduler(aScheduler),
+        [ptr=&state, nextPtr=next.iStatePtr, handler=std::forward<taHandler>(aHandler)]() mutable
         { 
-          std::cout << "Then executor " << count << ": waiting to lock " << &(ptr->iMutex) << std::endl;
-	  std::unique_lock<std::mutex> l(ptr->iMutex);
-          ptr->iConditionVariable.wait(l, [ptr](){return ptr->iState != PromiseState::PENDING;});
-          std::cout << "Then executor " << count << ": locked " << &(ptr->iMutex) << std::endl;
-	  if (ptr->iState == PromiseState::REJECTED)
+          ptr->Observe(TraceEvent::CONTINUATION_RAN);
+	  if (ptr->GetState() == PromiseState::REJECTED)
 	  {
-	    std::cout << "returning" << std::endl;
-	    // We don't handle rejected promises
+            nextPtr->Reject(ptr->iReason);
             return;
 	  }
-          l.unlock();
-          std::cout << "Then executor: unlocked " << &(ptr->iMutex) << std::endl;
           try 
           {
-	    const taNewResolvedType& newResult = aHandler(ptr->iResult);
-            aResolver(newResult);
+            nextPtr->Resolve(handler(HandlerArgument<taConsume>(*ptr)));
 	  }
           catch(...) 
           {
-	    aRejecter("Unexpected exception thrown!");
+	    nextPtr->Reject(std::current_exception());
 	  }
-          /*
-          l.unlock();
-          std::cout << "Then executor: unlocked " << &(ptr->iMutex) << std::endl;
-          // TODO: handle rejected state as well
-          // call inside l-lock()
-          aResolver(newResult); 
-          */
-        };
+        }, ContinuationReader<taConsume>());
    
-      return Promise<taNewResolvedType>(e);
+      return next;
     }
 
-    template<typename taNewResolvedType>
-    Promise<taNewResolvedType> then(const std::function<Promise<taNewResolvedType>(const taResolvedType&)>& aHandler) const
+    template<typename taRep, typename taPeriod>
+    static std::chrono::steady_clock::time_point Deadline(const std::chrono::duration<taRep, taPeriod>& aTimeout)
     {
-      typename Promise<taNewResolvedType>::TExecutor e = 
-	[ptr=this->iStatePtr, aHandler, count=this->iCount](const typename Promise<taNewResolvedType>::TResolver& aResolver, const typename Promise<taNewResolvedType>::TRejecter&)
-        { 
-	  std::cout << "Then promise executor " << count << ": waiting to lock " << &(ptr->iMutex) << std::endl;
-	  std::unique_lock<std::mutex> l(ptr->iMutex);
-          ptr->iConditionVariable.wait(l, [ptr](){return ptr->iState == PromiseState::FULFILLED;});
-          std::cout << "Then promise executor " << count << ": locked " << &(ptr->iMutex) << std::endl;
-          // TODO: wrap  with try/catch?
-	  Promise<taNewResolvedType> resultPromise = aHandler(ptr->iResult);
-          l.unlock();
-          // TODO: handle rejected state as well
-
-          // Resolve this promise when promise returned by handler resolves
-          std::function<int(const taNewResolvedType& aNextResult)> helper =  
-	  [aResolver](const taNewResolvedType& aNextResult)
-          { 
-            aResolver(aNextResult); // conversion to taResolvedType?
-            return 0;
-          };
-          resultPromise.then(helper); 
-        };
-
-      return Promise<taNewResolvedType>(e);
+      return std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(aTimeout);
     }
 
-    bool isPending() const 
-    { 
-      std::lock_guard<std::mutex> l(iStatePtr->iMutex);
-      return iStatePtr->iState == PromiseState::PENDING; 
-    }
- 
-    bool isFulfilled() const 
+    template<bool taConsume>
+    static Promise<taResolvedType> ThenTimeout(StatePtr<taResolvedType> aStatePtr, std::chrono::steady_clock::time_point aDeadline,
+                                               Executor* aScheduler)
     {
-      std::lock_guard<std::mutex> l(iStatePtr->iMutex);
-      return iStatePtr->iState == PromiseState::FULFILLED; 
+      Promise<taResolvedType> next(aScheduler ? *aScheduler : *aStatePtr->iScheduler);
+      // The timer holds next until the deadline at the latest: Cancel() drops it when this promise settles first
+      TimerQueue::TTimerId timerId = GetTimerQueue().Schedule(aDeadline, [nextPtr=next.iStatePtr]()
+      {
+        nextPtr->Reject(std::make_exception_ptr(TimeoutError()));
+      });
+
+      // Inline: passes the outcome on and drops the timer as soon as this promise settles
+      PromiseStateHolder<taResolvedType>& state = *aStatePtr;
+      state.AddContinuation(nullptr, [ptr=&state, nextPtr=next.iStatePtr, timerId]()
+      {
+        GetTimerQueue().Cancel(timerId);
+        if (ptr->GetState() == PromiseState::REJECTED)
+        {
+          nextPtr->Reject(ptr->iReason);
+          return;
+        }
+        try
+        {
+          nextPtr->Resolve(HandlerArgument<taConsume>(*ptr));
+        }
+        catch(...)
+        {
+          nextPtr->Reject(std::current_exception());
+        }
+      }, ContinuationReader<taConsume>());
+
+      return next;
     }
-  
-    bool isRejected() const 
+
+    template<bool taConsume, typename taHandler>
+    static Promise<taResolvedType> ThenCatch(StatePtr<taResolvedType> aStatePtr, taHandler&& aHandler, Executor* aScheduler)
     {
-      std::lock_guard<std::mutex> l(iStatePtr->iMutex);
-      return iStatePtr->iState == PromiseState::REJECTED; 
-    }
+      Promise<taResolvedType> next(aScheduler ? *aScheduler : *aStatePtr->iScheduler);
+      PromiseStateHolder<taResolvedType>& state = *aStatePtr;
 
-    taResolvedType GetResult() const
-    { 
-      std::cout << " GetResult: locking " << &(iStatePtr->iMutex) << std::endl;
-      std::lock_guard<std::mutex> l(iStatePtr->iMutex);
-      std::cout << " GetResult: locked " << &(iStatePtr->iMutex) << std::endl;
-      return iStatePtr->iResult; 
+      // Continuation: runs once this promise settled, passes the result on or executes handler
+      state.AddContinuation(state.ContinuationScheduler(aScheduler),
+        [ptr=&state, nextPtr=next.iStatePtr, handler=std::forward<taHandler>(aHandler)]() mutable
+        {
+          ptr->Observe(TraceEvent::CONTINUATION_RAN);
+          if (ptr->GetState() == PromiseState::FULFILLED)
+          {
+            nextPtr->Resolve(HandlerArgument<taConsume>(*ptr));
+            return;
+          }
+          try
+          {
+            nextPtr->Resolve(handler(static_cast<const std::exception_ptr&>(ptr->iReason)));
+          }
+          catch(...)
+          {
+            nextPtr->Reject(std::current_exception());
+          }
+        }, ContinuationReader<taConsume>());
+
+      return next;
     }
- 
-    std::string GetReason() const 
-    { 
-      std::lock_guard<std::mutex> l(iStatePtr->iMutex);
-      return iStatePtr->iReason; 
+
+    template<typename taNewResolvedType, bool taConsume, typename taHandler>
+    static Promise<taNewResolvedType> ThenPromise(StatePtr<taResolvedType> aStatePtr, taHandler&& aHandler, Executor* aScheduler)
+    {
+      Promise<taNewResolvedType> next(aScheduler ? *aScheduler : *aStatePtr->iScheduler);
+      PromiseStateHolder<taResolvedType>& state = *aStatePtr;
+
+      state.AddContinuation(state.ContinuationScheduler(aScheduler),
+	[ptr=&state, nextPtr=next.iStatePtr, handler=std::forward<taHandler>(aHandler)]() mutable
+        { 
+          ptr->Observe(TraceEvent::CONTINUATION_RAN);
+	  if (ptr->GetState() == PromiseState::REJECTED)
+	  {
+            nextPtr->Reject(ptr->iReason);
+            return;
+	  }
+
+          StatePtr<taNewResolvedType> resultPtr;
+          try 
+          {
+	    resultPtr = std::move(handler(HandlerArgument<taConsume>(*ptr)).iStatePtr);
+	  }
+          catch(...) 
+          {
+	    nextPtr->Reject(std::current_exception());
+            return;
+	  }
+
+          // Settle next promise when promise returned by handler settles; takes over the reader count of that handle
+          PromiseStateHolder<taNewResolvedType>& result = *resultPtr;
+          result.AddContinuation(result.IsSettled() ? nullptr : nextPtr->iScheduler, [result=&result, nextPtr]()
+          { 
+            result->Observe(TraceEvent::CONTINUATION_RAN);
+            if (result->GetState() == PromiseState::FULFILLED)
+              nextPtr->Resolve(Promise<taNewResolvedType>::TakeFrom(*result));
+            else
+              nextPtr->Reject(result->iReason);
+          }, PromiseStateHolder<void>::Reader::TAKEN_OVER);
+        }, ContinuationReader<taConsume>());
+
+      return next;
     }
 
-  private:
-    std::shared_future<void> iExecutorFuture;
-    int iCount;
-    std::shared_ptr<PromiseStateHolder<taResolvedType>> iStatePtr;
+    StatePtr<taResolvedType> iStatePtr;
   };
 
   
@@ -340,120 +1366,480 @@ namespace NPromise {
   };
   */
 
-} // namespace Promise
+  /*
+     Combinators over a runtime number of promises: iterator range or std::vector
+
+       All(): vector of all results in input order; rejects with the first rejection
+       AllSettled(): vector with the outcome of every input once all of them settled; never rejects
+       Race(): settles like the first input that settles
+       Any(): result of the first input that fulfills; rejects with an AggregateError once all inputs rejected
 
-  // helpers for NPromise::All
+     Each input gets one inline continuation that updates a shared aggregate with an atomic countdown;
+     no helper promises, no tasks and no waiting threads. The inputs may be destroyed right after the call.
+     Results are copied out of inputs the caller keeps, so those need copyable result types. A std::vector rvalue
+     (std::move(promises)) or a range of rvalues (std::make_move_iterator()) hands its promises over instead: their
+     results are moved out unless another handle still reads them (see TakeResult()). A result that cannot be read
+     counts as a rejection of its input.
+     aScheduler is the scheduler of the returned Promise, GetDefaultExecutor() if null.
+   */
 
-  template<int taResultIndex, typename taThisResultType, typename... taTupleTypes>
-  void AttachOne(const NPromise::Promise<taThisResultType>& aPromise, std::mutex& aMutex, std::condition_variable& aCondition, int& aCounter, std::tuple<taTupleTypes...>& aTuple, std::string& aReason, std::vector<NPromise::Promise<int>>& aPromiseStore )
+  template<typename taResolvedType>
+  struct SettledResult
   {
-    std::cout << "Attacher " << taResultIndex << std::endl; 
-    // lambda that stores result in nth element of aTuple
-    auto& resultStore = std::get<taResultIndex>(aTuple);
-
-    /*
-    const std::function<void(const taResolvedType&, const typename Promise<taNewResolvedType>::TResolver&, 
-                                                             const typename Promise<taNewResolvedType>::TRejecter&)>& aResolveHandler,
-                                    const std::function<void(const std::string&, const typename Promise<taNewResolvedType>::TResolver&,
-                                                             const typename Promise<taNewResolvedType>::TRejecter&)>& aRejectHandler
-
-
-     */
-    std::function<void(const taThisResultType&, const typename NPromise::Promise<int>::TResolver&, 
-                       const typename NPromise::Promise<int>::TRejecter& )> resultHandler =
-      [&resultStore, &aMutex, &aCondition, &aCounter](const taThisResultType& aResult, const typename NPromise::Promise<int>::TResolver&, 
-						      const typename NPromise::Promise<int>::TRejecter&)
-      {
-	std::unique_lock<std::mutex> l(aMutex);
-	resultStore = aResult;
-	aCounter++;
-	std::cout << "Resolved promise " << taResultIndex << std::endl;
-	l.unlock();
-	aCondition.notify_one();
-      };
+    PromiseState iState; // FULFILLED or REJECTED
+    std::optional<taResolvedType> iResult;
+    std::exception_ptr iReason;
+  };
+
+  // Rejection reason of Any() when no input fulfilled; reasons are in input order
+  class AggregateError : public std::exception
+  {
+  public:
+    explicit AggregateError(std::vector<std::exception_ptr> aReasons)
+      : iReasons(std::move(aReasons))
+    {
+    }
+
+    const char* what() const noexcept override { return "All promises were rejected"; }
+
+    const std::vector<std::exception_ptr>& GetReasons() const { return iReasons; }
+
+  private:
+    std::vector<std::exception_ptr> iReasons;
+  };
+
+  namespace NDetail {
+    struct PromiseAccess
+    {
+      template<typename taResolvedType>
+      static Promise<taResolvedType> MakePending(Executor* aScheduler)
+      {
+        return Promise<taResolvedType>(aScheduler ? *aScheduler : GetDefaultExecutor());
+      }
+
+      template<typename taResolvedType>
+      static const StatePtr<taResolvedType>& GetState(const Promise<taResolvedType>& aPromise)
+      {
+        return aPromise.iStatePtr;
+      }
+
+      // The reader count of the handle goes with the state: pass it on with Reader::TAKEN_OVER
+      template<typename taResolvedType>
+      static StatePtr<taResolvedType> ReleaseState(Promise<taResolvedType>&& aPromise)
+      {
+        return std::move(aPromise.iStatePtr);
+      }
+
+      template<typename taResolvedType>
+      static taResolvedType TakeFrom(PromiseStateHolder<taResolvedType>& aState)
+      {
+        return Promise<taResolvedType>::TakeFrom(aState);
+      }
+    };
+
+    template<typename taIterator>
+    using PromiseResolvedType = typename std::iterator_traits<taIterator>::value_type::TResolvedType;
+
+    // Ranges of rvalues (std::move_iterator) hand their promises over to the combinator
+    template<typename taIterator>
+    constexpr bool ConsumesInputs = std::is_same<typename std::iterator_traits<taIterator>::reference,
+                                                 typename std::iterator_traits<taIterator>::value_type&&>::value;
+
+    // Result of a combinator input: moved out of an input handed over (if nothing else reads it), copied otherwise
+    template<bool taConsume, typename taResolvedType>
+    taResolvedType ReadInput(PromiseStateHolder<taResolvedType>& aInput)
+    {
+      if constexpr (taConsume)
+        return PromiseAccess::TakeFrom(aInput);
+      else
+      {
+        static_assert(std::is_copy_constructible<taResolvedType>::value,
+                      "results that cannot be copied need the inputs handed over: std::move(promises) or std::make_move_iterator()");
+        return aInput.iResult;
+      }
+    }
 
-    std::function<void(const std::string&, const typename NPromise::Promise<int>::TResolver&, 
-		      const typename NPromise::Promise<int>::TRejecter&)> rejectHandler =
-      [&aReason, &aMutex, &aCondition, &aCounter](const std::string& aRejectReason, const typename NPromise::Promise<int>::TResolver&, 
-						  const typename NPromise::Promise<int>::TRejecter&)
-      {
-	std::unique_lock<std::mutex> l(aMutex);
-	aReason = aRejectReason;
-	aCounter++;
-	std::cout << "Rejected promise " << taResultIndex << std::endl;
-	l.unlock();
-	aCondition.notify_one();
+    // Calls aCallback(input state) inline once aPromise settles; with taConsume aPromise is an rvalue whose handle
+    // the continuation takes over
+    template<bool taConsume, typename taPromise, typename taCallback>
+    void OnInputSettled(taPromise&& aPromise, const taCallback& aCallback)
+    {
+      typedef typename PromiseTraits<std::decay_t<taPromise>>::TResolvedType TResolvedType;
+
+      auto attach = [&aCallback](PromiseStateHolder<TResolvedType>& aInput, PromiseStateHolder<void>::Reader aReader)
+      {
+        aInput.AddContinuation(nullptr, [aCallback, input=&aInput]() { aCallback(*input); }, aReader);
       };
-    
+      if constexpr (taConsume)
+      {
+        StatePtr<TResolvedType> statePtr = PromiseAccess::ReleaseState(std::move(aPromise));
+        attach(*statePtr, PromiseStateHolder<void>::Reader::TAKEN_OVER);
+      }
+      else
+        attach(*PromiseAccess::GetState(aPromise), PromiseStateHolder<void>::Reader::ADDED);
+    }
 
-    // These push_backs are executed in sequence, so no lock required
-    aPromiseStore.push_back(std::move(aPromise.template then<int>(resultHandler, rejectHandler)));
-    std::cout << "Attacher " << taResultIndex << "end" << std::endl;
+    // Calls aCallback(index, input state) once for every input promise, inline when it settles
+    template<typename taIterator, typename taCallback>
+    void ForEachSettled(taIterator aBegin, taIterator aEnd, const taCallback& aCallback)
+    {
+      std::size_t index = 0;
+      for (taIterator it = aBegin; it != aEnd; ++it, ++index)
+      {
+        OnInputSettled<ConsumesInputs<taIterator>>(*it, [aCallback, index](PromiseStateHolder<PromiseResolvedType<taIterator>>& aInput)
+        {
+          aCallback(index, aInput);
+        });
+      }
+    }
   }
 
-  template<int taIndex, int taMax, typename... taResolvedTypes>
-  struct Attacher
+  template<typename taIterator>
+  Promise<std::vector<NDetail::PromiseResolvedType<taIterator>>> All(taIterator aBegin, taIterator aEnd, Executor* aScheduler = nullptr)
   {
-    static void Apply(std::mutex& aMutex, std::condition_variable& aCondition, int& aCounter, std::tuple<taResolvedTypes...>& aTuple, std::string& aReason,
-                      const std::tuple<const NPromise::Promise<taResolvedTypes>&...>& aPromises, std::vector<NPromise::Promise<int>>& aPromiseStore)
+    typedef NDetail::PromiseResolvedType<taIterator> TResolvedType;
+
+    struct Aggregate
+    {
+      std::vector<std::optional<TResolvedType>> iResults;
+      std::atomic<std::size_t> iRemaining;
+      StatePtr<std::vector<TResolvedType>> iOutputPtr;
+    };
+
+    Promise<std::vector<TResolvedType>> output = NDetail::PromiseAccess::MakePending<std::vector<TResolvedType>>(aScheduler);
+    const std::size_t n = std::distance(aBegin, aEnd);
+    if (n == 0)
     {
-      AttachOne<taIndex, typename std::tuple_element<taIndex, std::tuple<taResolvedTypes...>>::type, taResolvedTypes...>(std::get<taIndex>(aPromises), aMutex, aCondition, aCounter, aTuple, aReason, aPromiseStore);
-      Attacher<taIndex+1, taMax, taResolvedTypes...>::Apply(aMutex, aCondition, aCounter, aTuple, aReason, aPromises, aPromiseStore); 
+      NDetail::PromiseAccess::GetState(output)->Resolve(std::vector<TResolvedType>());
+      return output;
     }
-  };
 
-  template<int n, typename... taTypes>
-  struct Attacher<n, n, taTypes...>
+    std::shared_ptr<Aggregate> aggregate = std::make_shared<Aggregate>();
+    aggregate->iResults.resize(n);
+    aggregate->iRemaining.store(n, std::memory_order_relaxed);
+    aggregate->iOutputPtr = NDetail::PromiseAccess::GetState(output);
+
+    NDetail::ForEachSettled(aBegin, aEnd, [aggregate](std::size_t aIndex, PromiseStateHolder<TResolvedType>& aInput)
+    {
+      if (aInput.GetState() == PromiseState::REJECTED)
+      {
+        // First rejection settles the output, later ones are ignored
+        aggregate->iOutputPtr->Reject(aInput.iReason);
+        return;
+      }
+      if (aggregate->iOutputPtr->GetState() != PromiseState::PENDING)
+        return;
+
+      try
+      {
+        aggregate->iResults[aIndex].emplace(NDetail::ReadInput<NDetail::ConsumesInputs<taIterator>>(aInput));
+      }
+      catch(...)
+      {
+        aggregate->iOutputPtr->Reject(std::current_exception());
+        return;
+      }
+      if (aggregate->iRemaining.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+
+      std::vector<TResolvedType> results;
+      results.reserve(aggregate->iResults.size());
+      for (std::optional<TResolvedType>& result : aggregate->iResults)
+        results.push_back(std::move(*result));
+      aggregate->iOutputPtr->Resolve(std::move(results));
+    });
+
+    return output;
+  }
+
+  template<typename taIterator>
+  Promise<std::vector<SettledResult<NDetail::PromiseResolvedType<taIterator>>>> AllSettled(taIterator aBegin, taIterator aEnd, Executor* aScheduler = nullptr)
   {
-    static void Apply(std::mutex& aMutex, std::condition_variable& aCondition, int& aCounter, std::tuple<taTypes...>& aTuple, std::string& aReason,
-                      const std::tuple<const NPromise::Promise<taTypes>&...>& aPromises, std::vector<NPromise::Promise<int>>& aPromiseStore)
-    { // NOP
+    typedef NDetail::PromiseResolvedType<taIterator> TResolvedType;
+
+    struct Aggregate
+    {
+      std::vector<SettledResult<TResolvedType>> iResults;
+      std::atomic<std::size_t> iRemaining;
+      StatePtr<std::vector<SettledResult<TResolvedType>>> iOutputPtr;
+    };
+
+    Promise<std::vector<SettledResult<TResolvedType>>> output = NDetail::PromiseAccess::MakePending<std::vector<SettledResult<TResolvedType>>>(aScheduler);
+    const std::size_t n = std::distance(aBegin, aEnd);
+    if (n == 0)
+    {
+      NDetail::PromiseAccess::GetState(output)->Resolve(std::vector<SettledResult<TResolvedType>>());
+      return output;
     }
-  };
 
+    std::shared_ptr<Aggregate> aggregate = std::make_shared<Aggregate>();
+    aggregate->iResults.resize(n);
+    aggregate->iRemaining.store(n, std::memory_order_relaxed);
+    aggregate->iOutputPtr = NDetail::PromiseAccess::GetState(output);
 
-namespace NPromise {
-  // template, specialize for 1 and more promises?
-  template<typename... taResolvedTypes>
-  Promise<std::tuple<taResolvedTypes...>> All(const Promise<taResolvedTypes>&... aPromises)
+    NDetail::ForEachSettled(aBegin, aEnd, [aggregate](std::size_t aIndex, PromiseStateHolder<TResolvedType>& aInput)
+    {
+      SettledResult<TResolvedType>& result = aggregate->iResults[aIndex];
+      result.iState = aInput.GetState();
+      if (result.iState == PromiseState::FULFILLED)
+      {
+        try
+        {
+          result.iResult.emplace(NDetail::ReadInput<NDetail::ConsumesInputs<taIterator>>(aInput));
+        }
+        catch(...)
+        {
+          result.iState = PromiseState::REJECTED;
+          result.iReason = std::current_exception();
+        }
+      }
+      else
+        result.iReason = aInput.iReason;
+
+      if (aggregate->iRemaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        aggregate->iOutputPtr->Resolve(std::move(aggregate->iResults));
+    });
+
+    return output;
+  }
+
+  template<typename taIterator>
+  Promise<NDetail::PromiseResolvedType<taIterator>> Race(taIterator aBegin, taIterator aEnd, Executor* aScheduler = nullptr)
   {
-    constexpr int n = sizeof...(aPromises);
-  
-    // problem:
-    typename Promise<std::tuple<taResolvedTypes...>>::TExecutor e = 
-      [params = std::forward_as_tuple(aPromises...)](typename Promise<std::tuple<taResolvedTypes...>>::TResolver aResolver, typename Promise<std::tuple<taResolvedTypes...>>::TRejecter aRejecter)
-      {
-	std::mutex m;
-	std::condition_variable c;
-	std::tuple<taResolvedTypes...> result; 
-        // struct to hold n helper Promises, one for each input promise
-        // moved in here so that AttachOne, and therefore All, returns immediately
-	std::vector<NPromise::Promise<int>> promises;
-        // prevent Promise copy constructor being called due to vector memory allocation upon push_back()
-        promises.reserve(n);
-	int counter = 0;
-        // TODO: cannot reject with empty string? Add boolean var instead
-	std::string reason("");
-
-	Attacher<0, n, taResolvedTypes...>::Apply(m, c, counter, result, reason, params, promises);
-
-	// wait for all promises to resolve
-        // TODO pass flag for failed promise and check that one as well
-	std::unique_lock<std::mutex> l(m);
-	c.wait(l, [&counter, &reason](){return (counter == n) || (reason.size() > 0);});
-	std::cout << "Resolving All" << std::endl;
-        if (reason.size() == 0)
-	{
-	  aResolver(result);        
+    typedef NDetail::PromiseResolvedType<taIterator> TResolvedType;
+
+    Promise<TResolvedType> output = NDetail::PromiseAccess::MakePending<TResolvedType>(aScheduler);
+    NDetail::ForEachSettled(aBegin, aEnd, [outputPtr=NDetail::PromiseAccess::GetState(output)](std::size_t, PromiseStateHolder<TResolvedType>& aInput)
+    {
+      // The output ignores every settle call after the first
+      if (outputPtr->GetState() != PromiseState::PENDING)
+        return;
+      if (aInput.GetState() == PromiseState::REJECTED)
+      {
+        outputPtr->Reject(aInput.iReason);
+        return;
+      }
+      try
+      {
+        outputPtr->Resolve(NDetail::ReadInput<NDetail::ConsumesInputs<taIterator>>(aInput));
+      }
+      catch(...)
+      {
+        outputPtr->Reject(std::current_exception());
+      }
+    });
+
+    return output;
+  }
+
+  template<typename taIterator>
+  Promise<NDetail::PromiseResolvedType<taIterator>> Any(taIterator aBegin, taIterator aEnd, Executor* aScheduler = nullptr)
+  {
+    typedef NDetail::PromiseResolvedType<taIterator> TResolvedType;
+
+    struct Aggregate
+    {
+      std::vector<std::exception_ptr> iReasons;
+      std::atomic<std::size_t> iRemaining;
+      StatePtr<TResolvedType> iOutputPtr;
+    };
+
+    Promise<TResolvedType> output = NDetail::PromiseAccess::MakePending<TResolvedType>(aScheduler);
+    const std::size_t n = std::distance(aBegin, aEnd);
+    if (n == 0)
+    {
+      NDetail::PromiseAccess::GetState(output)->Reject(std::make_exception_ptr(AggregateError({})));
+      return output;
+    }
+
+    std::shared_ptr<Aggregate> aggregate = std::make_shared<Aggregate>();
+    aggregate->iReasons.resize(n);
+    aggregate->iRemaining.store(n, std::memory_order_relaxed);
+    aggregate->iOutputPtr = NDetail::PromiseAccess::GetState(output);
+
+    NDetail::ForEachSettled(aBegin, aEnd, [aggregate](std::size_t aIndex, PromiseStateHolder<TResolvedType>& aInput)
+    {
+      std::exception_ptr reason = aInput.iReason;
+      if (aInput.GetState() == PromiseState::FULFILLED)
+      {
+        if (aggregate->iOutputPtr->GetState() != PromiseState::PENDING)
+          return;
+        try
+        {
+          aggregate->iOutputPtr->Resolve(NDetail::ReadInput<NDetail::ConsumesInputs<taIterator>>(aInput));
+          return;
         }
-        else 
-	{
-	  aRejecter(reason);
-	}
-      };
+        catch(...)
+        {
+          reason = std::current_exception();
+        }
+      }
+
+      aggregate->iReasons[aIndex] = reason;
+      if (aggregate->iRemaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        aggregate->iOutputPtr->Reject(std::make_exception_ptr(AggregateError(std::move(aggregate->iReasons))));
+    });
+
+    return output;
+  }
+
+  template<typename taResolvedType>
+  Promise<std::vector<taResolvedType>> All(const std::vector<Promise<taResolvedType>>& aPromises, Executor* aScheduler = nullptr)
+  {
+    return All(aPromises.begin(), aPromises.end(), aScheduler);
+  }
+
+  template<typename taResolvedType>
+  Promise<std::vector<taResolvedType>> All(std::vector<Promise<taResolvedType>>&& aPromises, Executor* aScheduler = nullptr)
+  {
+    return All(std::make_move_iterator(aPromises.begin()), std::make_move_iterator(aPromises.end()), aScheduler);
+  }
+
+  // Same, but rejects with CancelledError as soon as aToken is cancelled; the inputs are not affected
+  template<typename taIterator>
+  Promise<std::vector<NDetail::PromiseResolvedType<taIterator>>> All(taIterator aBegin, taIterator aEnd, const CancellationToken& aToken,
+                                                                      Executor* aScheduler = nullptr)
+  {
+    Promise<std::vector<NDetail::PromiseResolvedType<taIterator>>> output = All(aBegin, aEnd, aScheduler);
+    NDetail::RejectOnCancel(NDetail::PromiseAccess::GetState(output), aToken);
+    return output;
+  }
+
+  template<typename taResolvedType>
+  Promise<std::vector<taResolvedType>> All(const std::vector<Promise<taResolvedType>>& aPromises, const CancellationToken& aToken,
+                                           Executor* aScheduler = nullptr)
+  {
+    return All(aPromises.begin(), aPromises.end(), aToken, aScheduler);
+  }
+
+  template<typename taResolvedType>
+  Promise<std::vector<taResolvedType>> All(std::vector<Promise<taResolvedType>>&& aPromises, const CancellationToken& aToken,
+                                           Executor* aScheduler = nullptr)
+  {
+    return All(std::make_move_iterator(aPromises.begin()), std::make_move_iterator(aPromises.end()), aToken, aScheduler);
+  }
+
+  template<typename taResolvedType>
+  Promise<std::vector<SettledResult<taResolvedType>>> AllSettled(const std::vector<Promise<taResolvedType>>& aPromises, Executor* aScheduler = nullptr)
+  {
+    return AllSettled(aPromises.begin(), aPromises.end(), aScheduler);
+  }
+
+  template<typename taResolvedType>
+  Promise<std::vector<SettledResult<taResolvedType>>> AllSettled(std::vector<Promise<taResolvedType>>&& aPromises, Executor* aScheduler = nullptr)
+  {
+    return AllSettled(std::make_move_iterator(aPromises.begin()), std::make_move_iterator(aPromises.end()), aScheduler);
+  }
+
+  template<typename taResolvedType>
+  Promise<taResolvedType> Race(const std::vector<Promise<taResolvedType>>& aPromises, Executor* aScheduler = nullptr)
+  {
+    return Race(aPromises.begin(), aPromises.end(), aScheduler);
+  }
+
+  template<typename taResolvedType>
+  Promise<taResolvedType> Race(std::vector<Promise<taResolvedType>>&& aPromises, Executor* aScheduler = nullptr)
+  {
+    return Race(std::make_move_iterator(aPromises.begin()), std::make_move_iterator(aPromises.end()), aScheduler);
+  }
+
+  template<typename taResolvedType>
+  Promise<taResolvedType> Any(const std::vector<Promise<taResolvedType>>& aPromises, Executor* aScheduler = nullptr)
+  {
+    return Any(aPromises.begin(), aPromises.end(), aScheduler);
+  }
+
+  template<typename taResolvedType>
+  Promise<taResolvedType> Any(std::vector<Promise<taResolvedType>>&& aPromises, Executor* aScheduler = nullptr)
+  {
+    return Any(std::make_move_iterator(aPromises.begin()), std::make_move_iterator(aPromises.end()), aScheduler);
+  }
+
+  namespace NDetail {
+    // Aggregate of the variadic All(): owned by the continuations on the inputs, so it outlives the call and the inputs
+    template<typename... taResolvedTypes>
+    struct TupleAggregate
+    {
+      std::tuple<std::optional<taResolvedTypes>...> iResults;
+      std::atomic<std::size_t> iRemaining;
+      StatePtr<std::tuple<taResolvedTypes...>> iOutputPtr;
+
+      template<std::size_t... taIndices>
+      std::tuple<taResolvedTypes...> Collect(std::index_sequence<taIndices...>)
+      {
+        return std::tuple<taResolvedTypes...>(std::move(*std::get<taIndices>(iResults))...);
+      }
+    };
+
+    template<typename taPromise>
+    using HandleResolvedType = typename PromiseTraits<std::decay_t<taPromise>>::TResolvedType;
+
+    // Copies the result out of an lvalue input, takes over an rvalue one like a range of rvalues does
+    template<std::size_t taIndex, typename taPromise, typename... taResolvedTypes>
+    void AttachOne(const std::shared_ptr<TupleAggregate<taResolvedTypes...>>& aAggregate, taPromise&& aPromise)
+    {
+      constexpr bool consume = std::is_same<taPromise, std::decay_t<taPromise>>::value;
+      OnInputSettled<consume>(std::forward<taPromise>(aPromise), [aggregate=aAggregate](PromiseStateHolder<HandleResolvedType<taPromise>>& aInput)
+      {
+        if (aInput.GetState() == PromiseState::REJECTED)
+        {
+          // First rejection settles the output, later ones are ignored
+          aggregate->iOutputPtr->Reject(aInput.iReason);
+          return;
+        }
+        if (aggregate->iOutputPtr->GetState() != PromiseState::PENDING)
+          return;
+
+        try
+        {
+          std::get<taIndex>(aggregate->iResults).emplace(ReadInput<consume>(aInput));
+        }
+        catch(...)
+        {
+          aggregate->iOutputPtr->Reject(std::current_exception());
+          return;
+        }
+        if (aggregate->iRemaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+          aggregate->iOutputPtr->Resolve(aggregate->Collect(std::index_sequence_for<taResolvedTypes...>()));
+      });
+    }
+
+    template<typename... taResolvedTypes, std::size_t... taIndices, typename... taPromises>
+    void AttachAll(const std::shared_ptr<TupleAggregate<taResolvedTypes...>>& aAggregate, std::index_sequence<taIndices...>,
+                   taPromises&&... aPromises)
+    {
+      (AttachOne<taIndices>(aAggregate, std::forward<taPromises>(aPromises)), ...);
+    }
 
-    return Promise<std::tuple<taResolvedTypes...>>(e);
+    template<typename... taPromises>
+    using EnableIfPromises = std::enable_if_t<(PromiseTraits<std::decay_t<taPromises>>::IsPromise && ...)>;
   }
 
+  // Tuple of all results; rejects with the first rejection. Works like the range version of All() above: results are
+  // copied out of lvalue inputs, rvalue inputs (std::move(p), or calls returning a Promise) are handed over
+  template<typename... taPromises, typename = NDetail::EnableIfPromises<taPromises...>>
+  Promise<std::tuple<NDetail::HandleResolvedType<taPromises>...>> All(Executor& aScheduler, taPromises&&... aPromises)
+  {
+    typedef std::tuple<NDetail::HandleResolvedType<taPromises>...> TResults;
+    typedef NDetail::TupleAggregate<NDetail::HandleResolvedType<taPromises>...> TAggregate;
+
+    Promise<TResults> output = NDetail::PromiseAccess::MakePending<TResults>(&aScheduler);
+    std::shared_ptr<TAggregate> aggregate = std::make_shared<TAggregate>();
+    aggregate->iRemaining.store(sizeof...(taPromises), std::memory_order_relaxed);
+    aggregate->iOutputPtr = NDetail::PromiseAccess::GetState(output);
+    if constexpr (sizeof...(taPromises) == 0)
+      aggregate->iOutputPtr->Resolve(std::tuple<>());
+
+    NDetail::AttachAll(aggregate, std::index_sequence_for<taPromises...>(), std::forward<taPromises>(aPromises)...);
+    return output;
+  }
+
+  template<typename... taPromises, typename = NDetail::EnableIfPromises<taPromises...>>
+  Promise<std::tuple<NDetail::HandleResolvedType<taPromises>...>> All(taPromises&&... aPromises)
+  {
+    return All(GetDefaultExecutor(), std::forward<taPromises>(aPromises)...);
+  }
 
 } // namespace Promise
+
+#endif // PROMISE_H
@@ -0,0 +1,515 @@
+#ifndef PROMISE_STREAM_H
+#define PROMISE_STREAM_H
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "promise.h"
+
+/*
+   template class AsyncStream: sequence of values that arrive over time, read one at a time through promises
+
+     Producer: takes a StreamWriter<T> (AsyncStream<T>::TWriter), posted to the scheduler like a Promise executor;
+        or pass a TWriter to the constructor to feed the stream from existing code (an event loop, say)
+     Capacity: the stream buffers at most that many values in a ring buffer (PROMISE_STREAM_CAPACITY by default);
+        a full buffer holds the writer back instead of growing
+     Scheduler: Executor that next() and Write() promises and the stages run on; defaults to GetDefaultExecutor()
+
+     .next()
+        returns a Promise<std::optional<T>>: the next value, std::nullopt once the stream is closed and drained,
+        or rejected with the reason passed to Fail(); calls may be made before the previous one settled
+     .TryNext(value)
+        takes a buffered value without making a promise; false if there is none right now
+     .map(f), .filter(predicate), .batch(count)
+        return a new stream fed from this one on the scheduler: f(value), the values predicate accepts, and vectors of
+        count values (the last one shorter); a handler that throws fails the new stream.
+        A stage moves values straight from one ring buffer to the next, it only waits on a promise when one of them is
+        empty or full
+
+   template class StreamWriter
+     .TryWrite(value): false if the buffer is full or the stream is closed; value is left untouched then
+     .Write(value): Promise<bool> that fulfills with true once value is in the buffer, false if the stream was closed first
+     .Close(): ends the stream once the buffered values are read; done when the last writer is destroyed as well
+     .Fail(reason): same, but the reads after the buffered values reject with reason
+
+   A producer running on an executor should chain Write() with then() (or co_await it) rather than Wait() on it:
+   waiting keeps an executor thread busy until a reader makes room.
+
+   One writer and one reader at a time: calls on the writers of one stream must not race each other, nor must reads.
+   Once every AsyncStream handle of a stream is destroyed the stream closes, and pending and later writes yield false.
+ */
+
+#ifndef PROMISE_STREAM_CAPACITY
+#define PROMISE_STREAM_CAPACITY 64
+#endif
+
+namespace NPromise {
+
+  template<typename taItem>
+  class AsyncStream;
+
+  template<typename taItem>
+  class StreamWriter;
+
+  namespace NDetail {
+    // Bounded single-producer single-consumer ring with a locked slow path for writes and reads that have to wait.
+    // The writer pushes and the reader pops without a lock while nobody waits on their side; once a write or a read
+    // waits, Pump() moves values under iMutex until the waiting side catches up.
+    template<typename taItem>
+    class StreamState
+    {
+    public:
+      typedef std::optional<taItem> TOptional;
+
+      StreamState(std::size_t aCapacity, Executor& aScheduler)
+        : iSlots(new TOptional[aCapacity > 0 ? aCapacity : 1]), iCapacity(aCapacity > 0 ? aCapacity : 1), iHead(0), iTail(0),
+          iWaitingWrites(0), iWaitingReads(0), iClosed(false), iScheduler(&aScheduler)
+      {
+      }
+
+      StreamState(const StreamState&) = delete;
+      StreamState& operator=(const StreamState&) = delete;
+
+      Executor* GetScheduler() const { return iScheduler; }
+
+      std::size_t GetCapacity() const { return iCapacity; }
+
+      bool IsClosed() const { return iClosed.load(std::memory_order_acquire); }
+
+      // Leaves aItem untouched when it returns false
+      template<typename taValue>
+      bool TryWrite(taValue&& aItem)
+      {
+        if (iClosed.load(std::memory_order_acquire) || iWaitingWrites.load(std::memory_order_acquire) > 0)
+          return false;
+        if (!TryPush(std::forward<taValue>(aItem)))
+          return false;
+        if (iWaitingReads.load(std::memory_order_seq_cst) > 0)
+          Pump();
+        return true;
+      }
+
+      Promise<bool> Write(taItem aItem)
+      {
+        if (TryWrite(std::move(aItem)))
+          return Promise<bool>::Resolved(true, iScheduler);
+
+        Promise<bool> written = PromiseAccess::MakePending<bool>(iScheduler);
+        {
+          std::lock_guard<std::mutex> l(iMutex);
+          if (iClosed.load(std::memory_order_relaxed))
+            return Promise<bool>::Resolved(false, iScheduler);
+          iWriters.emplace_back(std::move(aItem), PromiseAccess::GetState(written));
+          iWaitingWrites.fetch_add(1, std::memory_order_seq_cst);
+        }
+        Pump();
+        return written;
+      }
+
+      bool TryNext(TOptional& aItem)
+      {
+        if (iWaitingReads.load(std::memory_order_acquire) > 0 || !TryPop(aItem))
+          return false;
+        // A waiting write is let in once the buffer is down to half: the writer then refills it without waiting,
+        // instead of the two sides handing over one value per wakeup
+        if (iWaitingWrites.load(std::memory_order_seq_cst) > 0 &&
+            iTail.load(std::memory_order_acquire) - iHead.load(std::memory_order_relaxed) <= iCapacity / 2)
+          Pump();
+        return true;
+      }
+
+      Promise<TOptional> Next()
+      {
+        TOptional item;
+        if (TryNext(item))
+          return Promise<TOptional>::Resolved(std::move(item), iScheduler);
+
+        Promise<TOptional> next = PromiseAccess::MakePending<TOptional>(iScheduler);
+        {
+          std::lock_guard<std::mutex> l(iMutex);
+          iReaders.push_back(PromiseAccess::GetState(next));
+          iWaitingReads.fetch_add(1, std::memory_order_seq_cst);
+        }
+        Pump();
+        return next;
+      }
+
+      // aReason null: plain end of the stream
+      void Close(std::exception_ptr aReason = nullptr)
+      {
+        {
+          std::lock_guard<std::mutex> l(iMutex);
+          if (iClosed.load(std::memory_order_relaxed))
+            return;
+          iReason = std::move(aReason);
+          iClosed.store(true, std::memory_order_release);
+        }
+        Pump();
+      }
+
+    private:
+      // Writer side, or Pump() on behalf of waiting writes
+      template<typename taValue>
+      bool TryPush(taValue&& aItem)
+      {
+        std::size_t tail = iTail.load(std::memory_order_acquire);
+        // seq_cst: pairs with the waiting counters, see TryWrite() and Next()
+        if (tail - iHead.load(std::memory_order_seq_cst) == iCapacity)
+          return false;
+        iSlots[tail % iCapacity].emplace(std::forward<taValue>(aItem));
+        iTail.store(tail + 1, std::memory_order_seq_cst);
+        return true;
+      }
+
+      // Reader side, or Pump() on behalf of waiting reads
+      bool TryPop(TOptional& aItem)
+      {
+        std::size_t head = iHead.load(std::memory_order_acquire);
+        if (head == iTail.load(std::memory_order_seq_cst))
+          return false;
+        TOptional& slot = iSlots[head % iCapacity];
+        aItem.emplace(std::move(*slot));
+        slot.reset();
+        iHead.store(head + 1, std::memory_order_seq_cst);
+        return true;
+      }
+
+      // Moves waiting writes into the ring and buffered values to waiting reads, then settles their promises
+      // outside the lock, posting the continuations with one PostBatch() per executor
+      void Pump()
+      {
+        std::vector<StatePtr<bool>> written;
+        std::vector<std::pair<StatePtr<TOptional>, TOptional>> read;
+        std::vector<StatePtr<bool>> dropped;
+        std::vector<StatePtr<TOptional>> ended;
+        std::exception_ptr reason;
+        {
+          std::lock_guard<std::mutex> l(iMutex);
+          for (bool progress = true; progress; )
+          {
+            progress = false;
+            while (!iWriters.empty() && TryPush(std::move(iWriters.front().first)))
+            {
+              written.push_back(std::move(iWriters.front().second));
+              iWriters.pop_front();
+              iWaitingWrites.fetch_sub(1, std::memory_order_acq_rel);
+              progress = true;
+            }
+            TOptional item;
+            while (!iReaders.empty() && TryPop(item))
+            {
+              read.emplace_back(std::move(iReaders.front()), std::move(item));
+              item.reset();
+              iReaders.pop_front();
+              iWaitingReads.fetch_sub(1, std::memory_order_acq_rel);
+              progress = true;
+            }
+          }
+
+          if (iClosed.load(std::memory_order_relaxed))
+          {
+            for (auto& writer : iWriters)
+              dropped.push_back(std::move(writer.second));
+            iWriters.clear();
+            iWaitingWrites.store(0, std::memory_order_release);
+            if (iHead.load(std::memory_order_acquire) == iTail.load(std::memory_order_acquire))
+            {
+              ended.assign(std::make_move_iterator(iReaders.begin()), std::make_move_iterator(iReaders.end()));
+              iReaders.clear();
+              iWaitingReads.store(0, std::memory_order_release);
+              reason = iReason;
+            }
+          }
+        }
+
+        // Most pumps settle a single promise, which is posted right away
+        ContinuationBatch batch;
+        ContinuationBatch* batchPtr = written.size() + read.size() + dropped.size() + ended.size() > 1 ? &batch : nullptr;
+        for (StatePtr<bool>& statePtr : written)
+          statePtr->Resolve(true, batchPtr);
+        for (auto& value : read)
+          value.first->Resolve(std::move(value.second), batchPtr);
+        for (StatePtr<bool>& statePtr : dropped)
+          statePtr->Resolve(false, batchPtr);
+        for (StatePtr<TOptional>& statePtr : ended)
+        {
+          if (reason)
+            statePtr->Reject(reason, batchPtr);
+          else
+            statePtr->Resolve(TOptional(), batchPtr);
+        }
+        batch.Flush();
+      }
+
+      std::unique_ptr<TOptional[]> iSlots;
+      const std::size_t iCapacity;
+      std::atomic<std::size_t> iHead; // next slot to read
+      std::atomic<std::size_t> iTail; // next slot to write
+      std::atomic<std::size_t> iWaitingWrites;
+      std::atomic<std::size_t> iWaitingReads;
+      std::atomic<bool> iClosed;
+      Executor* iScheduler;
+
+      // Slow path, guarded by iMutex
+      std::mutex iMutex;
+      std::deque<std::pair<taItem, StatePtr<bool>>> iWriters;
+      std::deque<StatePtr<TOptional>> iReaders;
+      std::exception_ptr iReason;
+    };
+
+    // Shared by the copies of one AsyncStream or StreamWriter: the last one closes the stream
+    template<typename taItem>
+    struct StreamEnd
+    {
+      explicit StreamEnd(std::shared_ptr<StreamState<taItem>> aStatePtr)
+        : iStatePtr(std::move(aStatePtr))
+      {
+      }
+
+      ~StreamEnd()
+      {
+        iStatePtr->Close();
+      }
+
+      std::shared_ptr<StreamState<taItem>> iStatePtr;
+    };
+
+    // Drives map(), filter() and batch(): aStep(input, output) is called with every input value and once with
+    // std::nullopt at the end, and may set output to the next value to write
+    template<typename taInput, typename taOutput, typename taStep>
+    class StreamStage : public std::enable_shared_from_this<StreamStage<taInput, taOutput, taStep>>
+    {
+    public:
+      StreamStage(AsyncStream<taInput> aSource, StreamWriter<taOutput> aSink, taStep aStep)
+        : iSource(std::move(aSource)), iSink(std::move(aSink)), iStep(std::move(aStep)), iEnded(false)
+      {
+      }
+
+      void Start()
+      {
+        iSink.GetState().GetScheduler()->Post([self=this->shared_from_this()]() { self->Run(); });
+      }
+
+    private:
+      // Runs until it has to wait for the source or the sink, then registers to continue on the scheduler
+      void Run()
+      {
+        StreamState<taOutput>& sink = iSink.GetState();
+        for (;;)
+        {
+          if (iOutput)
+          {
+            if (!sink.TryWrite(std::move(*iOutput)))
+            {
+              if (sink.IsClosed())
+                return;
+              Promise<bool> written = sink.Write(std::move(*iOutput));
+              iOutput.reset();
+              auto* writtenPtr = &*PromiseAccess::GetState(written);
+              writtenPtr->AddContinuation(sink.GetScheduler(), [self=this->shared_from_this(), writtenPtr]()
+              {
+                if (writtenPtr->GetState() == PromiseState::FULFILLED && writtenPtr->iResult)
+                  self->Run();
+              });
+              return;
+            }
+            iOutput.reset();
+          }
+
+          if (iEnded)
+          {
+            iSink.Close();
+            return;
+          }
+
+          std::optional<taInput> input;
+          if (!iSource.TryNext(input))
+          {
+            // The continuation takes over the handle, so it is the only reader and moves the item out
+            StatePtr<std::optional<taInput>> next = PromiseAccess::ReleaseState(iSource.next());
+            auto* nextPtr = &*next;
+            nextPtr->AddContinuation(sink.GetScheduler(), [self=this->shared_from_this(), nextPtr]()
+            {
+              if (nextPtr->GetState() == PromiseState::REJECTED)
+              {
+                self->iSink.Fail(nextPtr->iReason);
+                return;
+              }
+              if (self->Step(PromiseAccess::TakeFrom(*nextPtr)))
+                self->Run();
+            }, PromiseStateHolder<void>::Reader::TAKEN_OVER);
+            return;
+          }
+          if (!Step(std::move(input)))
+            return;
+        }
+      }
+
+      // False once the stage failed
+      bool Step(std::optional<taInput> aInput)
+      {
+        iEnded = !aInput;
+        try
+        {
+          iStep(aInput, iOutput);
+        }
+        catch(...)
+        {
+          iSink.Fail(std::current_exception());
+          return false;
+        }
+        return true;
+      }
+
+      AsyncStream<taInput> iSource;
+      StreamWriter<taOutput> iSink;
+      taStep iStep;
+      std::optional<taOutput> iOutput;
+      bool iEnded;
+    };
+  }
+
+  template<typename taItem>
+  class StreamWriter
+  {
+  public:
+    StreamWriter() {}
+
+    bool TryWrite(const taItem& aItem) const { return GetState().TryWrite(aItem); }
+    bool TryWrite(taItem&& aItem) const { return GetState().TryWrite(std::move(aItem)); }
+
+    Promise<bool> Write(taItem aItem) const { return GetState().Write(std::move(aItem)); }
+
+    void Close() const { GetState().Close(); }
+
+    void Fail(std::exception_ptr aReason) const { GetState().Close(aReason ? std::move(aReason) : std::make_exception_ptr(std::runtime_error("Stream failed"))); }
+
+    explicit operator bool() const { return iEndPtr != nullptr; }
+
+  private:
+    template<typename taOtherItem> friend class AsyncStream;
+    template<typename taInput, typename taOutput, typename taStep> friend class NDetail::StreamStage;
+
+    explicit StreamWriter(std::shared_ptr<NDetail::StreamState<taItem>> aStatePtr)
+      : iEndPtr(std::make_shared<NDetail::StreamEnd<taItem>>(std::move(aStatePtr)))
+    {
+    }
+
+    NDetail::StreamState<taItem>& GetState() const { return *iEndPtr->iStatePtr; }
+
+    std::shared_ptr<NDetail::StreamEnd<taItem>> iEndPtr;
+  };
+
+  template<typename taItem>
+  class AsyncStream
+  {
+  public:
+    typedef taItem TItem;
+    typedef StreamWriter<taItem> TWriter;
+
+    template<typename taProducer,
+             typename = std::enable_if_t<std::is_invocable<std::decay_t<taProducer>&, const TWriter&>::value>>
+    explicit AsyncStream(taProducer&& aProducer, std::size_t aCapacity = PROMISE_STREAM_CAPACITY, Executor* aScheduler = nullptr)
+    {
+      TWriter writer = Open(aCapacity, aScheduler);
+      GetState().GetScheduler()->Post([producer=std::forward<taProducer>(aProducer), writer]() mutable
+      {
+        try
+        {
+          producer(writer);
+        }
+        catch(...)
+        {
+          writer.Fail(std::current_exception());
+        }
+      });
+    }
+
+    // Stream fed through aWriter by the caller
+    explicit AsyncStream(TWriter& aWriter, std::size_t aCapacity = PROMISE_STREAM_CAPACITY, Executor* aScheduler = nullptr)
+    {
+      aWriter = Open(aCapacity, aScheduler);
+    }
+
+    Promise<std::optional<taItem>> next() const { return GetState().Next(); }
+
+    bool TryNext(std::optional<taItem>& aItem) const { return GetState().TryNext(aItem); }
+
+    template<typename taHandler>
+    auto map(taHandler&& aHandler) const
+    {
+      typedef std::decay_t<std::invoke_result_t<std::decay_t<taHandler>&, taItem&&>> TOutput;
+      return Stage<TOutput>([handler=std::forward<taHandler>(aHandler)](std::optional<taItem>& aInput, std::optional<TOutput>& aOutput) mutable
+      {
+        if (aInput)
+          aOutput.emplace(std::invoke(handler, std::move(*aInput)));
+      });
+    }
+
+    template<typename taPredicate>
+    AsyncStream<taItem> filter(taPredicate&& aPredicate) const
+    {
+      return Stage<taItem>([predicate=std::forward<taPredicate>(aPredicate)](std::optional<taItem>& aInput, std::optional<taItem>& aOutput) mutable
+      {
+        if (aInput && std::invoke(predicate, static_cast<const taItem&>(*aInput)))
+          aOutput = std::move(aInput);
+      });
+    }
+
+    AsyncStream<std::vector<taItem>> batch(std::size_t aCount) const
+    {
+      std::vector<taItem> values;
+      values.reserve(aCount);
+      return Stage<std::vector<taItem>>([values=std::move(values), aCount](std::optional<taItem>& aInput, std::optional<std::vector<taItem>>& aOutput) mutable
+      {
+        if (aInput)
+          values.push_back(std::move(*aInput));
+        if (values.empty() || (aInput && values.size() < aCount))
+          return;
+        aOutput.emplace(std::move(values));
+        values.clear();
+        values.reserve(aCount);
+      });
+    }
+
+  private:
+    template<typename taOtherItem> friend class AsyncStream;
+
+    AsyncStream() {}
+
+    TWriter Open(std::size_t aCapacity, Executor* aScheduler)
+    {
+      std::shared_ptr<NDetail::StreamState<taItem>> statePtr =
+        std::make_shared<NDetail::StreamState<taItem>>(aCapacity, aScheduler ? *aScheduler : GetDefaultExecutor());
+      iEndPtr = std::make_shared<NDetail::StreamEnd<taItem>>(statePtr);
+      return TWriter(std::move(statePtr));
+    }
+
+    // Output stream of the same capacity and scheduler, fed by a StreamStage
+    template<typename taOutput, typename taStep>
+    AsyncStream<taOutput> Stage(taStep&& aStep) const
+    {
+      AsyncStream<taOutput> output;
+      StreamWriter<taOutput> sink = output.Open(GetState().GetCapacity(), GetState().GetScheduler());
+      typedef NDetail::StreamStage<taItem, taOutput, std::decay_t<taStep>> TStage;
+      std::make_shared<TStage>(*this, std::move(sink), std::forward<taStep>(aStep))->Start();
+      return output;
+    }
+
+    NDetail::StreamState<taItem>& GetState() const { return *iEndPtr->iStatePtr; }
+
+    std::shared_ptr<NDetail::StreamEnd<taItem>> iEndPtr;
+  };
+
+} // namespace NPromise
+
+#endif // PROMISE_STREAM_H
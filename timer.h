@@ -0,0 +1,154 @@
+#ifndef PROMISE_TIMER_H
+#define PROMISE_TIMER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "function.h"
+#include "metrics.h"
+
+/*
+   class TimerQueue: runs callbacks at a deadline on one timer thread, ordered by a binary heap
+
+     Schedule()
+        registers a callback for a steady_clock deadline and returns its id; the callback runs on the timer thread,
+        so it must be short and must not throw
+     Cancel()
+        drops the callback if it did not run yet; its heap entry is discarded when it comes up
+     Callbacks that did not run yet are dropped when the queue is destroyed.
+
+   GetTimerQueue(): process-wide queue behind Promise::Timeout(); its thread starts on first use
+
+   class TimeoutError: the reason Promise::Timeout() rejects with
+ */
+
+namespace NPromise {
+
+  class TimeoutError : public std::exception
+  {
+  public:
+    const char* what() const noexcept override { return "Promise timed out"; }
+  };
+
+  class TimerQueue
+  {
+  public:
+    typedef std::chrono::steady_clock TClock;
+    typedef std::uint64_t TTimerId;
+    typedef Function<void()> TCallback;
+
+    TimerQueue()
+      : iStopping(false), iNextId(0)
+    {
+      iThread = std::thread([this](){ Run(); });
+    }
+
+    TimerQueue(const TimerQueue&) = delete;
+    TimerQueue& operator=(const TimerQueue&) = delete;
+
+    ~TimerQueue()
+    {
+      {
+        std::lock_guard<std::mutex> l(iMutex);
+        iStopping = true;
+      }
+      iConditionVariable.notify_all();
+      iThread.join();
+    }
+
+    TTimerId Schedule(TClock::time_point aDeadline, TCallback aCallback)
+    {
+      bool earliest;
+      TTimerId id;
+      {
+        std::lock_guard<std::mutex> l(iMutex);
+        id = ++iNextId;
+        iCallbacks.emplace(id, std::move(aCallback));
+        earliest = iDeadlines.empty() || aDeadline < iDeadlines.top().first;
+        iDeadlines.emplace(aDeadline, id);
+      }
+      if (earliest)
+        iConditionVariable.notify_one();
+      return id;
+    }
+
+    // True if the callback had not run yet and never will
+    bool Cancel(TTimerId aId)
+    {
+      TCallback callback;
+      {
+        std::lock_guard<std::mutex> l(iMutex);
+        auto it = iCallbacks.find(aId);
+        if (it == iCallbacks.end())
+          return false;
+        callback = std::move(it->second);
+        iCallbacks.erase(it);
+      }
+      return true;
+    }
+
+  private:
+    typedef std::pair<TClock::time_point, TTimerId> TDeadline;
+
+    void Run()
+    {
+      NDetail::CountMetric(NDetail::MetricsCounter::THREADS_STARTED);
+      std::unique_lock<std::mutex> l(iMutex);
+      while (!iStopping)
+      {
+        if (iDeadlines.empty())
+        {
+          iConditionVariable.wait(l);
+          continue;
+        }
+
+        TDeadline next = iDeadlines.top();
+        if (TClock::now() < next.first)
+        {
+          iConditionVariable.wait_until(l, next.first);
+          continue;
+        }
+
+        iDeadlines.pop();
+        auto it = iCallbacks.find(next.second);
+        if (it == iCallbacks.end())
+          continue;
+
+        TCallback callback = std::move(it->second);
+        iCallbacks.erase(it);
+        l.unlock();
+        callback();
+        callback = nullptr;
+        l.lock();
+      }
+      NDetail::CountMetric(NDetail::MetricsCounter::THREADS_EXITED);
+    }
+
+    std::mutex iMutex;
+    std::condition_variable iConditionVariable;
+    std::priority_queue<TDeadline, std::vector<TDeadline>, std::greater<TDeadline>> iDeadlines;
+    std::unordered_map<TTimerId, TCallback> iCallbacks;
+    bool iStopping;
+    TTimerId iNextId;
+    std::thread iThread;
+  };
+
+  // Never destroyed: continuations drained by executors during static destruction may still cancel timers
+  inline TimerQueue& GetTimerQueue()
+  {
+    static TimerQueue* queue = new TimerQueue;
+    return *queue;
+  }
+
+} // namespace NPromise
+
+#endif // PROMISE_TIMER_H